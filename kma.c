@@ -44,12 +44,16 @@
  *
  ***************************************************************************/
 #define __KMA_TEST_IMPL__
+#define _GNU_SOURCE
 
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -65,7 +69,8 @@
 enum REQ_STATE
   {
     FREE,
-    USED
+    USED,
+    REFUSED
   };
 
 typedef struct mem
@@ -76,6 +81,11 @@ typedef struct mem
   enum REQ_STATE state;
 } mem_t;
 
+#define MAXREQUEST (1024 * 1024)
+
+/* size of the pool handed to the buffer page provider */
+#define BUFFERSIZE (64L * 1024 * 1024)
+
 /************Global Variables*********************************************/
 
 static int val = 0;
@@ -89,6 +99,9 @@ void usage();
 void error(char*, char*);
 void pass();
 void fail();
+void sample(long**, int*, long);
+int compareSamples(const void*, const void*);
+long percentile(long*, int, double);
 
 /************External Declaration*****************************************/
 
@@ -100,6 +113,34 @@ int anyMismatches = 0;
 
 int currentAllocBytes = 0;
 
+int poolLimit = 0;
+
+// requests an exhausted pool had no room for, and the failures it
+// reported for them
+int refusedRequests = 0;
+
+int poolFailures = 0;
+
+// with -A every atomicEvery-th request is atomic; the time kma_malloc
+// took, for ordinary and for atomic requests
+int atomicEvery = 0;
+
+int atomicRequests = 0;
+
+int atomicRefused = 0;
+
+double mallocNs[2] = { 0.0, 0.0 };
+
+// the time of every kma_malloc and kma_free, for the tail of their
+// latency
+long* mallocSamples = NULL;
+
+int numMallocSamples = 0;
+
+long* freeSamples = NULL;
+
+int numFreeSamples = 0;
+
 char *name = NULL;
 
 int
@@ -108,6 +149,78 @@ main(int argc, char* argv[])
   
   name = argv[0];
   
+  int opt, decay = DECAYMS, retained = RETAINPAGES, nodes = 0, warm = 0;
+  int reserve = -1, low = -1;
+  bool retention = FALSE, background = FALSE, warmBackground = FALSE;
+  struct rusage faultUsage;
+  long faults;
+  char* source = NULL;
+  
+  while ((opt = getopt(argc, argv, "d:r:bN:w:W:P:L:R:A:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'd':
+	  decay = atoi(optarg);
+	  retention = TRUE;
+	  break;
+	case 'r':
+	  retained = atoi(optarg);
+	  retention = TRUE;
+	  break;
+	case 'b':
+	  background = TRUE;
+	  retention = TRUE;
+	  break;
+	case 'N':
+	  nodes = atoi(optarg);
+	  if (nodes < 1 || nodes > MAXNODES)
+	    {
+	      usage();
+	    }
+	  break;
+	case 'P':
+	  source = optarg;
+	  break;
+	case 'L':
+	  poolLimit = atoi(optarg);
+	  if (poolLimit < 1)
+	    {
+	      usage();
+	    }
+	  break;
+	case 'R':
+	  if (sscanf(optarg, "%d,%d", &reserve, &low) < 2)
+	    {
+	      low = 2 * reserve;
+	    }
+	  if (reserve < 0 || low < reserve)
+	    {
+	      usage();
+	    }
+	  break;
+	case 'A':
+	  atomicEvery = atoi(optarg);
+	  if (atomicEvery < 1)
+	    {
+	      usage();
+	    }
+	  break;
+	case 'W':
+	  warmBackground = TRUE;
+	  // fall through
+	case 'w':
+	  warm = atoi(optarg);
+	  if (warm < 1)
+	    {
+	      usage();
+	    }
+	  break;
+	default:
+	  usage();
+	}
+    }
+  
 #ifdef COMPETITION
   printf("%s: Running in competition mode\n", name);
 #endif
@@ -118,6 +231,8 @@ main(int argc, char* argv[])
 
   int n_req = 0, n_alloc=0, n_dealloc=0;
   kma_page_stat_t* stat;
+  int n;
+  double residentSum = 0.0;
 
 #ifdef COMPETITION
   double ratioSum = 0.0;
@@ -133,15 +248,68 @@ main(int argc, char* argv[])
   fprintf(allocTrace, "0 0 0\n");
 #endif
 
-  if (argc != 2)
+  if (optind != argc - 1 || decay <= 0 || retained < 0)
+    {
+      usage();
+    }
+  
+  if (retention)
+    {
+      page_retention(decay, retained, background);
+    }
+  
+  if (source == NULL || strcmp(source, "mmap") == 0)
+    {
+      page_provider(page_mmap_provider());
+    }
+  else if (strcmp(source, "static") == 0)
+    {
+      page_provider(page_static_provider());
+    }
+  else if (strcmp(source, "buffer") == 0)
+    {
+      void* buffer = malloc(BUFFERSIZE);
+      
+      if (buffer == NULL)
+	{
+	  error("unable to allocate the page pool buffer", "");
+	}
+      page_provider(page_buffer_provider(buffer, BUFFERSIZE));
+    }
+  else if (strncmp(source, "file:", 5) == 0)
+    {
+      page_provider(page_file_provider(source + 5,
+				       (long) MAXPAGES * PAGESIZE));
+    }
+  else
     {
       usage();
     }
   
-  FILE* f_test = fopen(argv[1], "r");
+  if (nodes > 0)
+    {
+      page_numa(nodes);
+    }
+  
+  if (poolLimit > 0)
+    {
+      page_limit(poolLimit);
+    }
+  
+  if (reserve >= 0)
+    {
+      page_watermarks(low, reserve);
+    }
+  
+  if (warm > 0)
+    {
+      page_warmup(warm, warmBackground);
+    }
+  
+  FILE* f_test = fopen(argv[optind], "r");
   if (f_test == NULL)
     {
-      error("unable to open input test file", argv[1]);
+      error("unable to open input test file", argv[optind]);
     }
   
   // Get the number of requests in the trace file
@@ -155,6 +323,11 @@ main(int argc, char* argv[])
   
   char command[16];
   int req_id, req_size, index = 1;
+  
+  // faults taken by this thread while it runs the trace; a background
+  // warm-up takes its own
+  getrusage(RUSAGE_THREAD, &faultUsage);
+  faults = faultUsage.ru_minflt;
 
   // Parse the lines in the file, and call allocate or
   // deallocate accordingly.
@@ -188,10 +361,11 @@ main(int argc, char* argv[])
 
       stat = page_stats();
       int totalBytes = stat->num_in_use * stat->page_size;
+      residentSum += stat->num_resident;
 
       
 #ifdef COMPETITION
-      if(req_id < n_req && n_alloc != n_dealloc)
+      if(req_id < n_req && n_alloc != n_dealloc && currentAllocBytes > 0)
 	{
 	  // We can calculate the ratio of wasted to used memory here.
 
@@ -212,13 +386,102 @@ main(int argc, char* argv[])
   fclose(allocTrace);
 #endif
   
+  getrusage(RUSAGE_THREAD, &faultUsage);
+  faults = faultUsage.ru_minflt - faults;
+  
   
   stat = page_stats();
   
   printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
 	 stat->num_requested, stat->num_freed, stat->num_in_use);	
+  printf("Spans Requested/Freed:       %5d/%5d\n",
+	 stat->num_spans_requested, stat->num_spans_freed);
+  printf("Chunks Mapped/Peak:          %5d/%5d\n",
+	 stat->num_chunks, stat->peak_chunks);
+  if (index > 1)
+    {
+      // a pool that never releases keeps its high-water mark resident
+      double avgResident = residentSum / (index - 1);
+      
+      printf("Resident Pages Avg/Peak:     %5.0f/%5d (%.0f KB saved)\n",
+	     avgResident, stat->peak_resident,
+	     (stat->peak_resident - avgResident) * stat->page_size / 1024);
+    }
+  printf("Pages Cached/Retained:       %5d/%5d\n",
+	 stat->num_cached, stat->num_retained);
+  if (stat->num_nodes > 1)
+    {
+      printf("NUMA Nodes/Fallbacks:        %5d/%5d (%s)\n",
+	     stat->num_nodes, stat->num_fallbacks,
+	     stat->nodes_bound ? "bound" : "not bound");
+      for (n = 0; n < stat->num_nodes; n++)
+	{
+	  printf("  Node %d Claimed/Chunks:      %5d/%5d\n",
+		 n, stat->node_pages[n], stat->node_chunks[n]);
+	}
+    }
+  for (n = 0; n < NUMPAGESIZES; n++)
+    {
+      if ((MINPAGESIZE << n) != PAGESIZE && stat->size_requested[n] > 0)
+	{
+	  printf("%2d KB Pages Requested/Freed: %5d/%5d\n",
+		 (MINPAGESIZE << n) / 1024, stat->size_requested[n],
+		 stat->size_freed[n]);
+	}
+      if (stat->size_in_use[n] != 0)
+	{
+	  error("not all pages freed", "");
+	}
+    }
+  if (poolLimit > 0 || refusedRequests > 0)
+    {
+      printf("Pool Limit/Refused Requests: %5d/%5d\n",
+	     poolLimit, refusedRequests);
+    }
+  if (stat->num_shrinks > 0 || stat->num_alloc_failures > 0)
+    {
+      printf("Shrinks/Reclaimed/Failures:  %5d/%5d/%5d\n",
+	     stat->num_shrinks, stat->num_reclaimed,
+	     stat->num_alloc_failures);
+    }
+  if (stat->num_low_crossings > 0)
+    {
+      printf("Low/Min Watermark Crossings: %5d/%5d\n",
+	     stat->num_low_crossings, stat->num_min_crossings);
+      printf("Reserve Pages/Throttled:     %5d/%5d\n",
+	     stat->num_reserve_pages, stat->num_throttled);
+    }
+  if (atomicEvery > 0)
+    {
+      printf("Atomic Requests/Refused:     %5d/%5d\n",
+	     atomicRequests, atomicRefused);
+      printf("Malloc ns Ordinary/Atomic:   %5.0f/%5.0f\n",
+	     mallocNs[0] / (n_alloc - atomicRequests),
+	     atomicRequests > 0 ? mallocNs[1] / atomicRequests : 0.0);
+    }
+  printf("Malloc ns p99.9/Max:         %5ld/%5ld\n",
+	 percentile(mallocSamples, numMallocSamples, 0.999),
+	 percentile(mallocSamples, numMallocSamples, 1.0));
+  printf("Free ns p99.9/Max:           %5ld/%5ld\n",
+	 percentile(freeSamples, numFreeSamples, 0.999),
+	 percentile(freeSamples, numFreeSamples, 1.0));
+  printf("Minor Faults:                %5ld\n", faults);
+  if (stat->num_warmed > 0)
+    {
+      printf("Pages Warmed/Faults Avoided: %5d/%5d\n",
+	     stat->num_warmed, stat->num_faults_avoided);
+    }
+  printf("Pool Inits/Avoided:          %5d/%5d\n",
+	 stat->num_inits, stat->num_inits_avoided);
+  printf("Page Provider: %s\n", stat->provider);
+  printf("Page Backing: %s\n",
+	 stat->backing == PAGE_BACKING_HUGETLB ? "hugetlb" :
+	 stat->backing == PAGE_BACKING_THP ? "transparent huge pages" :
+	 "small pages");
+  kma_report();
   
-  if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
+  if (stat->num_requested != stat->num_freed || stat->num_in_use != 0
+      || stat->num_spans_requested != stat->num_spans_freed)
     {
       error("not all pages freed", "");
     }
@@ -252,7 +515,22 @@ pass()
 
 void
 usage() {
-  printf("Usage: %s traceFile\n", name);
+  printf("Usage: %s [-d decayMs] [-r retainedPages] [-b] [-N nodes] "
+	 "[-w|-W warm] [-P provider] [-L pages] [-R min[,low]] [-A n] "
+	 "traceFile\n"
+	 "  -d  keep freed pages resident for decayMs milliseconds\n"
+	 "  -r  keep at most retainedPages freed pages resident\n"
+	 "  -b  return idle pages from a background thread\n"
+	 "  -N  split the page pool over nodes (fake) NUMA nodes\n"
+	 "  -w  pre-fault enough chunks for warm pages before starting\n"
+	 "  -W  pre-fault them from a background thread instead\n"
+	 "  -P  take pages from mmap (default), static, buffer or "
+	 "file:path\n"
+	 "  -L  take at most pages pages from the pool; requests it has "
+	 "no room for are skipped\n"
+	 "  -R  keep min free pages for atomic requests, reclaiming below low "
+	 "(2*min)\n"
+	 "  -A  make every nth request atomic\n", name);
   exit(0);
 }
 
@@ -265,16 +543,42 @@ error(char* message, char* arg ) {
 void
 allocate(mem_t* requests, int req_id, int req_size)
 {
+  static int count = 0;
   mem_t* new = &requests[req_id];
+  struct timespec begin, end;
+  long ns;
+  int atomic;
   
   assert(new->state == FREE);
   
+  atomic = (atomicEvery > 0 && count++ % atomicEvery == 0);
+  atomicRequests += atomic;
+  
   new->size = req_size;
-  new->ptr = kma_malloc(new->size);
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  new->ptr = kma_malloc_flags(new->size, atomic ? KMA_ATOMIC : KMA_NORMAL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  ns = (end.tv_sec - begin.tv_sec) * 1000000000L
+    + (end.tv_nsec - begin.tv_nsec);
+  mallocNs[atomic] += ns;
+  sample(&mallocSamples, &numMallocSamples, ns);
+  
+  // the pool may run out, most of all when capped; the request is then
+  // skipped, and so is its FREE
+  if (new->ptr == NULL && new->size <= MAXREQUEST
+      && page_stats()->num_alloc_failures > poolFailures)
+    {
+      poolFailures = page_stats()->num_alloc_failures;
+      refusedRequests++;
+      atomicRefused += atomic;
+      new->state = REFUSED;
+      return;
+    }
   
-  // Accept a NULL response in some cases... 
-  if(!(((new->ptr != NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
-       || ((new->ptr == NULL) && (new->size > (PAGESIZE - sizeof(void*))))))
+  // Accept a NULL response only beyond the largest request the
+  // allocators promise to serve
+  if(!(((new->ptr != NULL) && (new->size <= MAXREQUEST))
+       || ((new->ptr == NULL) && (new->size > MAXREQUEST))))
     {
       error("got NULL from kma_malloc for alloc'able request", "");
     }
@@ -310,6 +614,13 @@ void
 deallocate(mem_t* requests, int req_id)
 {
   mem_t* cur = &requests[req_id];
+  struct timespec begin, end;
+  
+  if (cur->state == REFUSED)
+    {
+      cur->state = FREE;
+      return;
+    }
   
   assert(cur->state == USED);
   assert(cur->size > 0);
@@ -324,7 +635,12 @@ deallocate(mem_t* requests, int req_id)
   free(cur->value);
 #endif
 
+  clock_gettime(CLOCK_MONOTONIC, &begin);
   kma_free(cur->ptr, cur->size);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  sample(&freeSamples, &numFreeSamples,
+	 (end.tv_sec - begin.tv_sec) * 1000000000L
+	 + (end.tv_nsec - begin.tv_nsec));
 
   currentAllocBytes -= cur->size;
   
@@ -357,3 +673,43 @@ check(char* lhs, char* rhs, int size)
 	}
     }
 }
+
+/* add a time to a list of them, growing it by powers of two */
+void
+sample(long** samples, int* count, long ns)
+{
+  if ((*count & (*count - 1)) == 0)
+    {
+      *samples = realloc(*samples, (*count > 0 ? 2 * *count : 1)
+			 * sizeof(long));
+      assert(*samples != NULL);
+    }
+  (*samples)[(*count)++] = ns;
+}
+
+int
+compareSamples(const void* a, const void* b)
+{
+  long x = *(const long*) a, y = *(const long*) b;
+  
+  return (x > y) - (x < y);
+}
+
+/* the time at or below which the fraction p of the samples fall; they
+ * are sorted in place */
+long
+percentile(long* samples, int count, double p)
+{
+  int i;
+  
+  if (count == 0)
+    {
+      return 0;
+    }
+  
+  qsort(samples, count, sizeof(long), compareSamples);
+  
+  i = (int) (p * count + 0.5) - 1;
+  
+  return samples[(i < 0) ? 0 : (i >= count) ? count - 1 : i];
+}
@@ -64,6 +64,13 @@
 #endif
 
 typedef int kma_size_t;
+
+/* flags for kma_malloc_flags: a high-priority allocation may use part
+ * of the pool's reserve of pages and an atomic one all of it, without
+ * ever waiting for pages to be reclaimed */
+#define KMA_NORMAL 0
+#define KMA_HIGH 1
+#define KMA_ATOMIC 2
 // typedef struct resourceEntry;
 
 /************Global Variables*********************************************/
@@ -81,6 +88,18 @@ typedef int kma_size_t;
  ***********************************************************************/
 EXTERN void* kma_malloc(kma_size_t size);
 
+/***********************************************************************
+ *  Title: Allocates kernel memory with a priority
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates size bytes like kma_malloc, but lets the
+ *             pages it needs come from the reserve when the pool is
+ *             low
+ *    Input: the size, KMA_NORMAL or KMA_HIGH and/or KMA_ATOMIC
+ *    Output: the allocated memory of the specified size
+ *            or NULL on failure
+ ***********************************************************************/
+EXTERN void* kma_malloc_flags(kma_size_t size, int flags);
+
 /***********************************************************************
  *  Title: Frees kernel memory spaced
  * ---------------------------------------------------------------------
@@ -92,6 +111,16 @@ EXTERN void* kma_malloc(kma_size_t size);
  ***********************************************************************/
 EXTERN void kma_free(void*, kma_size_t size);
 
+/***********************************************************************
+ *  Title: Reports allocator statistics
+ * ---------------------------------------------------------------------
+ *    Purpose: Prints what the allocator counts about itself; an
+ *             allocator that counts nothing prints nothing
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_report();
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
@@ -0,0 +1,311 @@
+/***************************************************************************
+ *  Title: Kernel Page Allocator Benchmark
+ * -------------------------------------------------------------------------
+ *    Purpose: Measures get_page()/free_page() throughput under contention
+ ***************************************************************************/
+#define __KMA_BENCH_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define MAXTHREADS 64
+
+#define WALKS 200
+
+/* per-page metadata as a backend would keep it, one cache line */
+typedef struct pageHeader
+{
+  struct pageHeader* next;
+  char data[CACHELINE - sizeof(struct pageHeader*)];
+} pageHeader;
+
+/************Global Variables*********************************************/
+
+static char* name;
+static int num_threads = 4;
+static long num_rounds = 20000;
+static int num_held = 64;
+static int num_nodes = 0;
+static int page_size = PAGESIZE;
+static int walk_pages = 0;
+static pthread_barrier_t start;
+
+/************Function Prototypes******************************************/
+void* hammer(void*);
+void walkBench();
+double walk(kma_page_t**, bool);
+double nowSec();
+void usage();
+void error(char*, char*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  pthread_t threads[MAXTHREADS];
+  kma_page_stat_t* stat;
+  double begin, elapsed;
+  long ops;
+  int opt, i;
+
+  name = argv[0];
+
+  while ((opt = getopt(argc, argv, "t:n:w:N:s:c:")) != -1)
+    {
+      switch (opt)
+	{
+	case 't':
+	  num_threads = atoi(optarg);
+	  break;
+	case 'n':
+	  num_rounds = atol(optarg);
+	  break;
+	case 'w':
+	  num_held = atoi(optarg);
+	  break;
+	case 'N':
+	  num_nodes = atoi(optarg);
+	  break;
+	case 's':
+	  page_size = atoi(optarg);
+	  break;
+	case 'c':
+	  walk_pages = atoi(optarg);
+	  break;
+	default:
+	  usage();
+	}
+    }
+
+  if (num_threads < 1 || num_threads > MAXTHREADS || num_rounds < 1
+      || num_held < 1 || (long) num_threads * num_held > MAXPAGES
+      || num_nodes < 0 || num_nodes > MAXNODES
+      || page_size < MINPAGESIZE || page_size > MAXPAGESIZE
+      || (page_size & (page_size - 1)) != 0
+      || walk_pages < 0 || walk_pages > MAXPAGES)
+    {
+      usage();
+    }
+
+  if (walk_pages > 0)
+    {
+      walkBench();
+      return 0;
+    }
+
+  if (num_nodes > 0)
+    {
+      page_numa(num_nodes);
+    }
+
+  pthread_barrier_init(&start, NULL, num_threads + 1);
+
+  for (i = 0; i < num_threads; i++)
+    {
+      if (pthread_create(&threads[i], NULL, hammer, (void*) (long) i) != 0)
+	{
+	  error("Error starting a benchmark thread", "");
+	}
+    }
+
+  pthread_barrier_wait(&start);
+  begin = nowSec();
+
+  for (i = 0; i < num_threads; i++)
+    {
+      pthread_join(threads[i], NULL);
+    }
+
+  elapsed = nowSec() - begin;
+
+  stat = page_stats();
+  ops = 0;
+  for (i = 0; i < NUMPAGESIZES; i++)
+    {
+      ops += (long) stat->size_requested[i] + stat->size_freed[i];
+    }
+
+  printf("Threads/Pages Held:          %5d/%5d\n", num_threads, num_held);
+  printf("Page Size:                    %5d\n", page_size);
+  printf("Operations:             %10ld\n", ops);
+  printf("Seconds:                %10.3f\n", elapsed);
+  printf("Operations/sec:         %10.0f\n", ops / elapsed);
+  printf("CAS Attempts/Retries:   %10ld/%ld\n",
+	 stat->num_cas, stat->num_cas_retries);
+  printf("CAS Retry Rate:         %10.4f\n",
+	 stat->num_cas > 0 ? (double) stat->num_cas_retries / stat->num_cas : 0);
+  printf("Pages In Use:                 %5d\n", stat->num_in_use);
+  for (i = 0; i < stat->num_nodes && stat->num_nodes > 1; i++)
+    {
+      printf("Node %d Chunks Mapped:         %5d\n", i, stat->node_chunks[i]);
+    }
+
+  pthread_barrier_destroy(&start);
+
+  return (stat->num_in_use == 0) ? 0 : 1;
+}
+
+/* allocates and frees num_held pages, num_rounds times; with a fake
+ * topology the threads take turns at the nodes */
+void*
+hammer(void* arg)
+{
+  kma_page_t** held = malloc(num_held * sizeof(kma_page_t*));
+  long r;
+  int i;
+
+  assert(held != NULL);
+
+  if (num_nodes > 0)
+    {
+      page_node((long) arg % num_nodes);
+    }
+
+  pthread_barrier_wait(&start);
+
+  for (r = 0; r < num_rounds; r++)
+    {
+      for (i = 0; i < num_held; i++)
+	{
+	  held[i] = get_page_sized(page_size);
+	  if (held[i] == NULL)
+	    {
+	      error("Error getting a page from the pool", "");
+	    }
+	  *(char*) held[i]->ptr = (char) i;
+	}
+      for (i = num_held - 1; i >= 0; i--)
+	{
+	  free_page(held[i]);
+	}
+    }
+
+  free(held);
+
+  return NULL;
+}
+
+/* walks the metadata of walk_pages live pages, once all at the start of
+ * their pages and once coloured */
+void
+walkBench()
+{
+  kma_page_t** pages = malloc(walk_pages * sizeof(kma_page_t*));
+  double plain, coloured;
+  int i;
+
+  assert(pages != NULL);
+
+  for (i = 0; i < walk_pages; i++)
+    {
+      pages[i] = get_page();
+      if (pages[i] == NULL)
+	{
+	  error("Error getting a page to walk", "");
+	}
+    }
+
+  plain = walk(pages, FALSE);
+  coloured = walk(pages, TRUE);
+
+  printf("Pages Walked:                 %5d\n", walk_pages);
+  printf("Uncoloured ns/page:     %10.2f\n", plain);
+  printf("Coloured ns/page:       %10.2f\n", coloured);
+  printf("Speedup:                %10.2f\n", plain / coloured);
+
+  for (i = 0; i < walk_pages; i++)
+    {
+      free_page(pages[i]);
+    }
+  free(pages);
+}
+
+/* links a header into every page, in page order like a backend's page
+ * list, and times walking the list */
+double
+walk(kma_page_t** pages, bool colour)
+{
+  pageHeader* head = NULL;
+  pageHeader* h;
+  double begin;
+  long sum = 0;
+  int i, w;
+
+  for (i = walk_pages - 1; i >= 0; i--)
+    {
+      h = (pageHeader*) ((char*) pages[i]->ptr
+			 + (colour ? page_colour(pages[i]->ptr) : 0));
+      h->next = head;
+      h->data[0] = (char) i;
+      head = h;
+    }
+
+  begin = nowSec();
+  for (w = 0; w < WALKS; w++)
+    {
+      for (h = head; h != NULL; h = h->next)
+	{
+	  sum += h->data[0];
+	}
+    }
+
+  // keep the walk from being optimised away
+  if (sum == -1)
+    {
+      printf("%ld\n", sum);
+    }
+
+  return (nowSec() - begin) * 1e9 / ((double) WALKS * walk_pages);
+}
+
+double
+nowSec()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+usage()
+{
+  printf("Usage: %s [-t threads] [-n rounds] [-w pagesHeld] [-N nodes] "
+	 "[-s pageSize] [-c pages]\n"
+	 "  -t  number of threads allocating at once (at most %d)\n"
+	 "  -n  rounds of allocating and freeing per thread\n"
+	 "  -w  pages each thread holds per round\n"
+	 "  -N  split the page pool over nodes (fake) NUMA nodes\n"
+	 "  -s  size of the pages, a power of two from %d to %d\n"
+	 "  -c  instead time walking the metadata of this many pages\n",
+	 name, MAXTHREADS, MINPAGESIZE, MAXPAGESIZE);
+  exit(0);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(1);
+}
@@ -70,15 +70,19 @@ void* kma_malloc(kma_size_t size)
 {
   kma_page_t* page;
   
-  // get one page
-  page = get_page();
-  
-  // add a pointer to the page structure at the beginning of the page
-  *((kma_page_t**)page->ptr) = page;
+  // get one page, or enough contiguous pages for a large request;
+  // the structure is found again through page_of
+  if (size > PAGESIZE)
+    {
+      page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+    }
+  else
+    {
+      page = get_page();
+    }
   
-  if ((size + sizeof(kma_page_t*)) > page->size)
-    { // requested size too large
-      free_page(page);
+  if (page == NULL)
+    { // the pool is exhausted
       return NULL;
     }
   
@@ -89,16 +93,19 @@ void* kma_malloc(kma_size_t size)
   //}
   // oh yea, it worked
   
-  return page->ptr + sizeof(kma_page_t*);
+  return page->ptr;
 }
 
 void kma_free(void* ptr, kma_size_t size)
 {
-  kma_page_t* page;
-  
-  page = *((kma_page_t**)(ptr - sizeof(kma_page_t*)));
-  
-  free_page(page);
+  if (size > PAGESIZE)
+    {
+      free_pages(page_of(ptr));
+    }
+  else
+    {
+      free_page(page_of(ptr));
+    }
 }
 
 #endif // KMA_DUMMY
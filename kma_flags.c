@@ -0,0 +1,53 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Entry points shared by all the allocators
+ ***************************************************************************/
+#define __KMA_FLAGS_IMPL__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/* the flags are handed to the page allocator as they are */
+#if KMA_HIGH != PAGE_HIGH || KMA_ATOMIC != PAGE_ATOMIC
+#error "kma_malloc_flags flags do not match the page priorities"
+#endif
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+/* every page the allocator takes for this request gets its priority,
+ * whichever allocator is built in */
+void*
+kma_malloc_flags(kma_size_t size, int flags)
+{
+  void* res;
+  int old;
+
+  old = page_priority(flags);
+  res = kma_malloc(size);
+  page_priority(old);
+
+  return res;
+}
+
+/* allocators with statistics of their own replace this one */
+void __attribute__((weak))
+kma_report()
+{
+}
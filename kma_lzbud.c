@@ -38,11 +38,13 @@
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
 
+
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
  *  Global variables begin with g. Global constants with k. Local
@@ -50,9 +52,77 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/* Blocks are powers of two from MINBLOCK bytes (order 0) up to a whole
+ * page (order MAXORDER). Requests larger than a page get a span. */
+#define MINSHIFT 5
+
+#define MINBLOCK (1 << MINSHIFT)
+
+#define MAXORDER (__builtin_ctz(PAGESIZE) - MINSHIFT)
+
+#define NUMORDERS (MAXORDER + 1)
+
+#define ORDEROF(size) ((size) <= MINBLOCK ? 0 \
+		       : 32 - __builtin_clz((size) - 1) - MINSHIFT)
+
+#define BLOCKSIZE(o) (MINBLOCK << (o))
+
+/* Whether a block is globally free is kept out of the pages, in one
+ * bitmap per page with a bit for every block of every order: the
+ * blocks of order o start at bit MAPBASE(o). */
+#define WORDBITS (8 * sizeof(unsigned long))
+
+#define MAPBITS (2 << MAXORDER)
+
+#define MAPWORDS ((MAPBITS + WORDBITS - 1) / WORDBITS)
+
+#define MAPBASE(o) (MAPBITS - (MAPBITS >> (o)))
+
+/* A freed block is either kept locally free, as if still allocated, or
+ * freed globally and merged with its buddy. Each order keeps
+ * slack = active - locally free, where active counts only the blocks
+ * handed out and not yet freed: with a slack of two or more a free is
+ * lazy, with one it coalesces, and with none it coalesces a locally
+ * free block as well. */
+typedef struct freeBlock
+{
+  struct freeBlock* next;
+  struct freeBlock* prev;
+} freeBlock;
+
+typedef struct
+{
+  int lazy;
+  int coalesced;
+  int deferred;
+  int merged;
+} orderStat;
+
 /************Global Variables*********************************************/
 
+// globally free blocks of each order, linked both ways, and locally
+// free ones, linked through next only
+static freeBlock* g_global[NUMORDERS];
+static freeBlock* g_local[NUMORDERS];
+
+static int g_active[NUMORDERS];
+static int g_num_local[NUMORDERS];
+
+static unsigned long g_free_map[MAXPAGES][MAPWORDS];
+
+static orderStat g_stats[NUMORDERS];
+static int g_pages_freed = 0;
+
+static bool g_shrinker = FALSE;
+
 /************Function Prototypes******************************************/
+void* allocBlock(int);
+void freeGlobal(freeBlock*, int);
+void pushGlobal(freeBlock*, int);
+void unlinkGlobal(freeBlock*, int);
+int mapBit(void*, int);
+bool isGlobal(void*, int);
+int shrinkLocal(void*, int);
 
 /************External Declaration*****************************************/
 
@@ -61,13 +131,244 @@
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+  kma_page_t* page;
+  freeBlock* block;
+  int o;
+  
+  if (!g_shrinker)
+    { // locally free blocks can be coalesced when the pool runs out
+      page_register_shrinker(shrinkLocal, NULL);
+      g_shrinker = TRUE;
+    }
+  
+  if (size > PAGESIZE)
+    {
+      page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+      return (page == NULL) ? NULL : page->ptr;
+    }
+  
+  o = ORDEROF(size);
+  
+  // a locally free block is the cheapest to hand out again
+  if (g_local[o] != NULL)
+    {
+      block = g_local[o];
+      g_local[o] = block->next;
+      g_num_local[o]--;
+    }
+  else
+    {
+      block = allocBlock(o);
+      if (block == NULL)
+	{
+	  return NULL;
+	}
+    }
+  
+  g_active[o]++;
+  
+  return block;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  freeBlock* block = ptr;
+  int o, slack;
+  
+  if (size > PAGESIZE)
+    {
+      free_pages(page_of(ptr));
+      return;
+    }
+  
+  o = ORDEROF(size);
+  
+  assert(g_active[o] > 0);
+  
+  slack = g_active[o] - g_num_local[o];
+  g_active[o]--;
+  
+  if (slack >= 2)
+    { // lazy: keep it for the next request of this order
+      block->next = g_local[o];
+      g_local[o] = block;
+      g_num_local[o]++;
+      g_stats[o].lazy++;
+      return;
+    }
+  
+  freeGlobal(block, o);
+  g_stats[o].coalesced++;
+  
+  if (slack == 0 && g_local[o] != NULL)
+    { // accelerated: catch up on a free that was deferred
+      block = g_local[o];
+      g_local[o] = block->next;
+      g_num_local[o]--;
+      freeGlobal(block, o);
+      g_stats[o].deferred++;
+    }
+}
+
+void
+kma_report()
+{
+  int o;
+  
+  printf("Order  Block  Lazy Frees  Coalesced  Deferred     Merged\n");
+  for (o = 0; o < NUMORDERS; o++)
+    {
+      printf("%5d  %5d  %10d %10d %9d %10d\n", o, BLOCKSIZE(o),
+	     g_stats[o].lazy, g_stats[o].coalesced, g_stats[o].deferred,
+	     g_stats[o].merged);
+    }
+}
+
+/* take a globally free block of order o, splitting a larger one or a
+ * new page if there is none */
+void*
+allocBlock(int o)
+{
+  kma_page_t* page;
+  freeBlock* block;
+  int j;
+  
+  for (j = o; j <= MAXORDER && g_global[j] == NULL; j++)
+    ;
+  
+  if (j > MAXORDER)
+    {
+      page = get_page();
+      if (page == NULL)
+	{
+	  return NULL;
+	}
+      block = page->ptr;
+      j = MAXORDER;
+    }
+  else
+    {
+      block = g_global[j];
+      unlinkGlobal(block, j);
+    }
+  
+  // the upper halves become globally free blocks of the orders below
+  while (j > o)
+    {
+      j--;
+      pushGlobal((freeBlock*) ((char*) block + BLOCKSIZE(j)), j);
+    }
+  
+  return block;
+}
+
+/* free a block globally, merging it with its buddy for as long as the
+ * buddy is globally free too; a whole page goes back to the pool */
+void
+freeGlobal(freeBlock* block, int o)
+{
+  freeBlock* buddy;
+  char* base = BASEADDR(block);
+  
+  for (; o < MAXORDER; o++)
+    {
+      buddy = (freeBlock*) (base + (((char*) block - base) ^ BLOCKSIZE(o)));
+      if (!isGlobal(buddy, o))
+	{
+	  pushGlobal(block, o);
+	  return;
+	}
+      
+      unlinkGlobal(buddy, o);
+      g_stats[o].merged++;
+      if (buddy < block)
+	{
+	  block = buddy;
+	}
+    }
+  
+  free_page(page_of(block));
+  g_pages_freed++;
+}
+
+void
+pushGlobal(freeBlock* block, int o)
+{
+  int i = page_index(block);
+  int bit = mapBit(block, o);
+  
+  g_free_map[i][bit / WORDBITS] |= 1UL << (bit % WORDBITS);
+  
+  block->prev = NULL;
+  block->next = g_global[o];
+  if (block->next != NULL)
+    {
+      block->next->prev = block;
+    }
+  g_global[o] = block;
+}
+
+void
+unlinkGlobal(freeBlock* block, int o)
+{
+  int i = page_index(block);
+  int bit = mapBit(block, o);
+  
+  g_free_map[i][bit / WORDBITS] &= ~(1UL << (bit % WORDBITS));
+  
+  if (block->prev != NULL)
+    {
+      block->prev->next = block->next;
+    }
+  else
+    {
+      g_global[o] = block->next;
+    }
+  if (block->next != NULL)
+    {
+      block->next->prev = block->prev;
+    }
+}
+
+/* bit of a block of order o in the bitmap of its page */
+int
+mapBit(void* block, int o)
+{
+  return MAPBASE(o) + (int) (((char*) block - (char*) BASEADDR(block))
+			     >> (MINSHIFT + o));
+}
+
+bool
+isGlobal(void* block, int o)
+{
+  int bit = mapBit(block, o);
+  
+  return (g_free_map[page_index(block)][bit / WORDBITS] >> (bit % WORDBITS))
+    & 1;
+}
+
+/* the shrinker: coalesce every locally free block, which frees the
+ * pages that were only held by them */
+int
+shrinkLocal(void* arg, int wanted)
+{
+  freeBlock* block;
+  int o, before = g_pages_freed;
+  
+  for (o = 0; o < NUMORDERS; o++)
+    {
+      while (g_local[o] != NULL)
+	{
+	  block = g_local[o];
+	  g_local[o] = block->next;
+	  g_num_local[o]--;
+	  freeGlobal(block, o);
+	  g_stats[o].deferred++;
+	}
+    }
+  
+  return g_pages_freed - before;
 }
 
 #endif // KMA_LZBUD
@@ -43,6 +43,7 @@
 #include "kma_page.h"
 #include "kma.h"
 
+
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
  *  Global variables begin with g. Global constants with k. Local
@@ -50,9 +51,65 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/* Requests are rounded up to a power of two from MINCLASS bytes to half
+ * a page. Every page is cut into blocks of one class only, and the
+ * blocks carry no header: kmemsizes keeps the class of every page.
+ * Larger requests get a page or a span of their own. */
+#define MINSHIFT 4
+
+#define MINCLASS (1 << MINSHIFT)
+
+#define NUMCLASSES 9
+
+#define MAXCLASS (MINCLASS << (NUMCLASSES - 1))
+
+/* class of a request: 0 for up to MINCLASS bytes, 1 for twice that, ... */
+#define CLASSOF(size) ((size) <= MINCLASS ? 0 \
+		       : 32 - __builtin_clz((size) - 1) - MINSHIFT)
+
+#define CLASSSIZE(c) (MINCLASS << (c))
+
+#define BLOCKSPERPAGE(c) (PAGESIZE >> ((c) + MINSHIFT))
+
+/* kmemsizes holds the class + 1 of a page cut into blocks, KMEMLARGE for
+ * the first page of a request of its own, and 0 for pages not in use */
+#define KMEMLARGE 0xff
+
+/* a class with blocks in use keeps up to KEEPPAGES pages without one,
+ * so that its pages are not given back and taken again all the time */
+#define KEEPPAGES 1
+
+/* free blocks of a class are threaded through the blocks themselves,
+ * both ways, so that a page's blocks can be taken off the list */
+typedef struct freeBlock
+{
+  struct freeBlock* next;
+  struct freeBlock* prev;
+} freeBlock;
+
 /************Global Variables*********************************************/
 
+// the class of every page of the pool, by page_index
+static unsigned char kmemsizes[MAXPAGES];
+
+// and how many of its blocks are free
+static unsigned short kmemfree[MAXPAGES];
+
+static freeBlock* g_free[NUMCLASSES];
+
+// blocks of each class in use, and its pages without a block in use
+static int g_used[NUMCLASSES];
+
+static int g_empty[NUMCLASSES];
+
+static bool g_shrinker = FALSE;
+
 /************Function Prototypes******************************************/
+void* ownPages(kma_size_t);
+bool cutPage(int);
+void dropPage(void*, int);
+int shrinkClasses(void*, int);
+int shrinkClass(int, int);
 
 /************External Declaration*****************************************/
 
@@ -61,13 +118,232 @@
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+  freeBlock* block;
+  int c, i;
+  
+  if (!g_shrinker)
+    { // the pages a class keeps can go when the pool runs out
+      page_register_shrinker(shrinkClasses, NULL);
+      g_shrinker = TRUE;
+    }
+  
+  if (size > MAXCLASS)
+    {
+      return ownPages(size);
+    }
+  
+  c = CLASSOF(size);
+  
+  if (g_free[c] == NULL && !cutPage(c))
+    {
+      return NULL;
+    }
+  
+  block = g_free[c];
+  g_free[c] = block->next;
+  if (block->next != NULL)
+    {
+      block->next->prev = NULL;
+    }
+  
+  i = page_index(block);
+  if (kmemfree[i] == BLOCKSPERPAGE(c))
+    {
+      g_empty[c]--;
+    }
+  kmemfree[i]--;
+  g_used[c]++;
+  
+  return block;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  freeBlock* block = ptr;
+  kma_page_t* page;
+  int i = page_index(ptr);
+  int c;
+  
+  // the page knows its class, the size is only checked against it
+  if (kmemsizes[i] == KMEMLARGE)
+    {
+      page = page_of(ptr);
+      
+      assert(size > MAXCLASS && size <= page->size);
+      
+      kmemsizes[i] = 0;
+      if (page->size > PAGESIZE)
+	{
+	  free_pages(page);
+	}
+      else
+	{
+	  free_page(page);
+	}
+      return;
+    }
+  
+  assert(kmemsizes[i] != 0);
+  c = kmemsizes[i] - 1;
+  assert(size <= CLASSSIZE(c));
+  
+  block->prev = NULL;
+  block->next = g_free[c];
+  if (block->next != NULL)
+    {
+      block->next->prev = block;
+    }
+  g_free[c] = block;
+  
+  kmemfree[i]++;
+  g_used[c]--;
+  if (kmemfree[i] == BLOCKSPERPAGE(c))
+    {
+      g_empty[c]++;
+      if (g_used[c] == 0)
+	{ // an idle class keeps nothing
+	  shrinkClass(c, g_empty[c]);
+	}
+      else if (g_empty[c] > KEEPPAGES)
+	{
+	  dropPage(BASEADDR(ptr), c);
+	}
+    }
+}
+
+/* a request larger than any class: a page or a span */
+void*
+ownPages(kma_size_t size)
+{
+  kma_page_t* page;
+  
+  if (size > PAGESIZE)
+    {
+      page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+    }
+  else
+    {
+      page = get_page();
+    }
+  
+  if (page == NULL)
+    {
+      return NULL;
+    }
+  
+  kmemsizes[page_index(page->ptr)] = KMEMLARGE;
+  
+  return page->ptr;
+}
+
+/* cut a new page into free blocks of class c */
+bool
+cutPage(int c)
+{
+  kma_page_t* page = get_page();
+  freeBlock* block;
+  char* base;
+  int i, n = BLOCKSPERPAGE(c);
+  
+  if (page == NULL)
+    {
+      return FALSE;
+    }
+  
+  base = page->ptr;
+  kmemsizes[page_index(base)] = c + 1;
+  kmemfree[page_index(base)] = n;
+  g_empty[c]++;
+  
+  // thread them in address order, ahead of the blocks already free
+  for (i = n - 1; i >= 0; i--)
+    {
+      block = (freeBlock*) (base + i * CLASSSIZE(c));
+      block->prev = NULL;
+      block->next = g_free[c];
+      if (block->next != NULL)
+	{
+	  block->next->prev = block;
+	}
+      g_free[c] = block;
+    }
+  
+  return TRUE;
+}
+
+/* take every block of a page without one in use off the free list of
+ * its class, and give the page back */
+void
+dropPage(void* base, int c)
+{
+  freeBlock* block;
+  int i;
+  
+  assert(kmemfree[page_index(base)] == BLOCKSPERPAGE(c));
+  
+  for (i = 0; i < BLOCKSPERPAGE(c); i++)
+    {
+      block = (freeBlock*) ((char*) base + i * CLASSSIZE(c));
+      if (block->prev != NULL)
+	{
+	  block->prev->next = block->next;
+	}
+      else
+	{
+	  g_free[c] = block->next;
+	}
+      if (block->next != NULL)
+	{
+	  block->next->prev = block->prev;
+	}
+    }
+  
+  kmemsizes[page_index(base)] = 0;
+  kmemfree[page_index(base)] = 0;
+  g_empty[c]--;
+  
+  free_page(page_of(base));
+}
+
+/* the shrinker: give back the pages the classes keep; they are found on
+ * the free lists, whose blocks all lie in pages of their class */
+int
+shrinkClasses(void* arg, int wanted)
+{
+  int c, released = 0;
+  
+  for (c = 0; c < NUMCLASSES && released < wanted; c++)
+    {
+      released += shrinkClass(c, wanted - released);
+    }
+  
+  return released;
+}
+
+/* give back up to wanted pages of class c without a block in use */
+int
+shrinkClass(int c, int wanted)
+{
+  freeBlock* block = g_free[c];
+  int released = 0;
+  
+  while (g_empty[c] > 0 && released < wanted && block != NULL)
+    {
+      if (kmemfree[page_index(block)] == BLOCKSPERPAGE(c))
+	{
+	  dropPage(BASEADDR(block), c);
+	  released++;
+	  // the next block may have been unlinked with the page
+	  block = g_free[c];
+	}
+      else
+	{
+	  block = block->next;
+	}
+    }
+  
+  return released;
 }
 
 #endif // KMA_MCK2
@@ -43,6 +43,7 @@
 #include "kma_page.h"
 #include "kma.h"
 
+
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
  *  Global variables begin with g. Global constants with k. Local
@@ -50,9 +51,59 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/* Requests are rounded up to a power of two from MINCLASS bytes on.
+ * The NUMCLASSES classes up to a quarter page are carved out of pages;
+ * larger requests get a half page, a page or a span of their own. */
+#define MINSHIFT 5
+
+#define MINCLASS (1 << MINSHIFT)
+
+#define NUMCLASSES 7
+
+#define MAXCLASS (MINCLASS << (NUMCLASSES - 1))
+
+/* class of a request: 0 for up to MINCLASS bytes, 1 for twice that, ... */
+#define CLASSOF(size) ((size) <= MINCLASS ? 0 \
+		       : 32 - __builtin_clz((size) - 1) - MINSHIFT)
+
+#define CLASSSIZE(c) (MINCLASS << (c))
+
+/* Every carved page keeps a header at the colour of the page, so that
+ * the headers of neighbouring pages fall into different cache sets; it
+ * is found from any of the blocks with HEADEROF. The blocks are laid out
+ * from the start of the page, aligned to their size, leaving out those
+ * the header overlaps. Blocks from top on have never been handed out;
+ * freed ones are threaded through their first word. */
+typedef struct pageHeader
+{
+  void* free;
+  char* top;
+  int used;
+  int class;
+  struct pageHeader* next;
+  struct pageHeader* prev;
+  kma_page_t* page;
+} pageHeader;
+
+/* the header takes one cache line */
+#define HEADERSIZE CACHELINE
+
+#define HEADEROF(ptr) ((pageHeader*) ((char*) BASEADDR(ptr) \
+				      + page_colour(ptr)))
+
+#define ALIGNUP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
 /************Global Variables*********************************************/
 
+// pages of each class with a block left, most recently freed into first
+static pageHeader* g_partial[NUMCLASSES];
+
 /************Function Prototypes******************************************/
+void* ownPages(kma_size_t);
+pageHeader* carvePage(int);
+char* nextBlock(pageHeader*);
+void linkPage(pageHeader*);
+void unlinkPage(pageHeader*);
 
 /************External Declaration*****************************************/
 
@@ -61,13 +112,181 @@
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+  pageHeader* h;
+  void* block;
+  int c;
+  
+  if (size > MAXCLASS)
+    {
+      return ownPages(size);
+    }
+  
+  c = CLASSOF(size);
+  h = g_partial[c];
+  
+  // only a class without free blocks needs a new page
+  if (h == NULL)
+    {
+      h = carvePage(c);
+      if (h == NULL)
+	{
+	  return NULL;
+	}
+    }
+  
+  if (h->free != NULL)
+    {
+      block = h->free;
+      h->free = *(void**) block;
+    }
+  else
+    {
+      block = nextBlock(h);
+      h->top = block + CLASSSIZE(c);
+    }
+  h->used++;
+  
+  // a full page leaves the list until a block of it is freed
+  if (h->free == NULL && nextBlock(h) == NULL)
+    {
+      unlinkPage(h);
+    }
+  
+  return block;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  pageHeader* h;
+  
+  if (size > MAXCLASS)
+    {
+      if (size > PAGESIZE)
+	{
+	  free_pages(page_of(ptr));
+	}
+      else
+	{
+	  free_page(page_of(ptr));
+	}
+      return;
+    }
+  
+  h = HEADEROF(ptr);
+  
+  assert(h->class == CLASSOF(size));
+  assert(h->used > 0);
+  
+  if (h->free == NULL && nextBlock(h) == NULL)
+    { // it was full
+      linkPage(h);
+    }
+  
+  *(void**) ptr = h->free;
+  h->free = ptr;
+  h->used--;
+  
+  if (h->used == 0)
+    {
+      unlinkPage(h);
+      free_page(h->page);
+    }
+}
+
+/* a request above the largest class: a half page, a page or a span */
+void*
+ownPages(kma_size_t size)
+{
+  kma_page_t* page;
+  
+  if (size > PAGESIZE)
+    {
+      page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+    }
+  else if (size > MINPAGESIZE)
+    {
+      page = get_page();
+    }
+  else
+    {
+      page = get_page_sized(MINPAGESIZE);
+    }
+  
+  return (page == NULL) ? NULL : page->ptr;
+}
+
+/* take a new page for class c; its blocks are carved off as they are
+ * asked for, so this takes constant time too */
+pageHeader*
+carvePage(int c)
+{
+  kma_page_t* page = get_page();
+  pageHeader* h;
+  
+  if (page == NULL)
+    {
+      return NULL;
+    }
+  
+  assert(sizeof(pageHeader) <= HEADERSIZE);
+  
+  h = HEADEROF(page->ptr);
+  h->free = NULL;
+  h->top = page->ptr;
+  h->used = 0;
+  h->class = c;
+  h->page = page;
+  
+  linkPage(h);
+  
+  return h;
+}
+
+/* where the next block never handed out goes, past the header; NULL
+ * once the page has no room left for one */
+char*
+nextBlock(pageHeader* h)
+{
+  char* base = BASEADDR(h);
+  char* block = h->top;
+  int size = CLASSSIZE(h->class);
+  
+  if (block < (char*) h + HEADERSIZE && block + size > (char*) h)
+    {
+      block = base + ALIGNUP((char*) h - base + HEADERSIZE, size);
+    }
+  
+  return (block + size <= base + PAGESIZE) ? block : NULL;
+}
+
+void
+linkPage(pageHeader* h)
+{
+  h->prev = NULL;
+  h->next = g_partial[h->class];
+  if (h->next != NULL)
+    {
+      h->next->prev = h;
+    }
+  g_partial[h->class] = h;
+}
+
+void
+unlinkPage(pageHeader* h)
+{
+  if (h->prev != NULL)
+    {
+      h->prev->next = h->next;
+    }
+  else
+    {
+      g_partial[h->class] = h->next;
+    }
+  if (h->next != NULL)
+    {
+      h->next->prev = h->prev;
+    }
 }
 
 #endif // KMA_P2FL
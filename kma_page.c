@@ -45,6 +45,12 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -57,16 +63,312 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+#define CHUNKSIZE (CHUNKPAGES * PAGESIZE)
+
+#define WORDBITS (8 * sizeof(unsigned long))
+
+#define CHUNKWORDS ((MAXCHUNKS + WORDBITS - 1) / WORDBITS)
+
+#define PAGEWORDS ((CHUNKPAGES + WORDBITS - 1) / WORDBITS)
+
+#define POOLWORDS ((MAXPAGES + WORDBITS - 1) / WORDBITS)
+
+#define SETBIT(map, i) ((map)[(i) / WORDBITS] |= 1UL << ((i) % WORDBITS))
+
+#define CLEARBIT(map, i) ((map)[(i) / WORDBITS] &= ~(1UL << ((i) % WORDBITS)))
+
+#define TESTBIT(map, i) (((map)[(i) / WORDBITS] >> ((i) % WORDBITS)) & 1)
+
+/* idle pages are looked for SCAVENGESTEPS times per decay period */
+#define SCAVENGESTEPS 4
+
+/* every thread caches up to MAGAZINE free pages of its own and moves
+ * them from and to the pool MAGAZINEBATCH at a time */
+#define MAGAZINE 32
+
+#define MAGAZINEBATCH (MAGAZINE / 2)
+
+/* magazines overflow into a lock-free depot of up to DEPOTPAGES pages
+ * per node before pages go back to the pool */
+#define DEPOTPAGES (4 * MAGAZINE)
+
+/* the depot head packs a version tag above the top page's index + 1, so
+ * a head that was popped and pushed again no longer compares equal */
+#define DEPOTINDEX(x) ((int)((x) & 0xffffffffUL) - 1)
+
+#define DEPOTHEAD(tag, i) ((((tag) + 1) << 32) | (unsigned long)((i) + 1))
+
+/* thread caches are only written by their own thread, but page_stats
+ * reads them from any thread */
+#define BUMP(x, d) __atomic_store_n(&(x), (x) + (d), __ATOMIC_RELAXED)
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+/* MADV_DONTNEED drops a released page at once; MADV_FREE lets the
+ * kernel reclaim it lazily, which is cheaper but keeps RSS up until
+ * there is memory pressure */
+#if defined(KMA_LAZY_RELEASE) && defined(MADV_FREE)
+#define RELEASE_ADVICE MADV_FREE
+#else
+#define RELEASE_ADVICE MADV_DONTNEED
+#endif
+
+#define RESERVESIZE ((long) MAXPAGES * PAGESIZE + CHUNKSIZE)
+
+/* index of the page a pool address belongs to */
+#define PAGEOF(x) ((int)(((char*)(x) - (char*)pool) / PAGESIZE))
+
+/* index of the chunk a pool address belongs to */
+#define CHUNKOF(x) ((int)(((char*)(x) - (char*)pool) / CHUNKSIZE))
+
+/* start address of a chunk */
+#define CHUNKADDR(c) ((void*)((char*)pool + (long)(c) * CHUNKSIZE))
+
+/* first chunk of a node's range of the pool, and the node of a chunk */
+#define NODEFIRST(n) ((int)(((long)(n) * pool_chunks + num_nodes - 1) / num_nodes))
+
+#define NODEOF(c) ((int)((long)(c) * num_nodes / pool_chunks))
+
+/* index of a page size in the per-size statistics */
+#define SIZECLASS(size) (__builtin_ctz(size) - __builtin_ctz(MINPAGESIZE))
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+/* Pages at or above top have never been handed out since the chunk was
+ * mapped and are taken in order. Pages below it that were freed are kept
+ * in a bitmap rather than threaded through the pages themselves: a
+ * released page loses its contents. Freed pages that are still resident
+ * are also marked in dirty_map. */
+typedef struct
+{
+  unsigned long free_map[PAGEWORDS];
+  unsigned long dirty_map[PAGEWORDS];
+  int top;
+  int num_in_use;
+  int num_dirty;
+  kma_backing_t backing;
+  bool pinned;
+} kma_chunk_t;
+
+typedef struct kma_cache
+{
+  void* pages[MAGAZINE];
+  int count;
+  int num_requested;
+  int num_freed;
+  int num_in_use;
+  long num_cas;
+  long num_cas_retries;
+  bool registered;
+  struct kma_cache* next;
+} kma_cache_t;
+
+typedef struct
+{
+  kma_shrinker_t shrink;
+  void* arg;
+} kma_shrinker_entry_t;
+
 /************Global Variables*********************************************/
-static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE };
+static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE, 0, 0, 0, 0, 0,
+					       PAGE_BACKING_SMALL, 0, 0, 0,
+					       0, 0, 0, 0, 0, 0, 0, 0, 0,
+					       { 0 }, { 0 }, { 0 }, { 0 }, { 0 },
+					       0, 0, 0, 0, 0, 0, 0, 0, 0,
+					       NULL };
 
+static void* region = NULL;
+static long region_size = 0;
+
+// chunks the provider had room for, at most MAXCHUNKS
+static int pool_chunks = MAXCHUNKS;
 static void* pool = NULL;
-static void* next_free_page = NULL;
+
+static kma_chunk_t chunks[MAXCHUNKS];
+
+// one descriptor per pool page, so a page address finds its descriptor;
+// the pages inside a span point at the first page of the span
+static kma_page_t page_table[MAXPAGES];
+
+// pages split into two MINPAGESIZE pages: page_table describes the
+// lower half and half_table the upper one, halves has a bit for each
+// half in use, and half_avail marks split pages with a free half;
+// page_of reads halves without the lock, so it is stored atomically
+static kma_page_t half_table[MAXPAGES];
+static unsigned char halves[MAXPAGES];
+static unsigned long half_avail[POOLWORDS];
+static int next_id = 0;
+
+// pages taken from the pool, whether in use or sitting in a thread cache,
+// and how many may be at once (0 for no limit)
+static int pool_claimed = 0;
+static int pool_limit = 0;
+
+// no page was in use at the last free, but the pool kept its pages
+static bool pool_emptied = FALSE;
+
+// free pages below which ordinary allocations reclaim first, and below
+// which only high-priority and atomic ones are served; none are kept
+// back unless page_watermarks asks for it
+static int watermark_low = 0;
+static int watermark_min = 0;
+static __thread int my_priority = 0;
+
+// called in turn when the pool runs out, before an allocation fails
+static kma_shrinker_entry_t shrinkers[MAXSHRINKERS];
+static int num_shrinkers = 0;
+
+// this thread's magazine, and the list of all of them for page_stats
+static __thread kma_cache_t cache;
+static kma_cache_t* caches = NULL;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+// each node's depot is a Treiber stack linked through depot_next by
+// page index
+static unsigned long depot_head[MAXNODES];
+static int depot_next[MAXPAGES];
+static int depot_count[MAXNODES];
+
+// each depot's head as the scavenger last saw it; one that has not moved
+// for a whole pass is idle
+static unsigned long depot_seen[MAXNODES];
+
+// num_nodes only changes while the pool is released (see page_numa)
+static int num_nodes = 1;
+static int real_nodes = 1;
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+static __thread int my_node = -1;
+
+// every page of the pool that is in use, single or part of a span
+static unsigned long page_used[POOLWORDS];
+
+// bitmaps over the chunks: which are mapped, which have free pages
+static unsigned long chunk_mapped[CHUNKWORDS];
+static unsigned long chunk_avail[CHUNKWORDS];
+
+// chunks at or above top have not been mapped since the pool was reserved
+static int chunk_top = 0;
+
+// the same, within each node's range of chunks
+static int node_top[MAXNODES];
+
+// chunks holding dirty pages, and when each dirty page was freed
+static unsigned long chunk_dirty[CHUNKWORDS];
+static long dirty_since[MAXPAGES];
+
+// the magazines and depots read max_retained without the lock
+static int decay_ms = DECAYMS;
+static int max_retained = RETAINPAGES;
+static long next_scavenge = 0;
+
+// the pool is shared by all threads, including the scavenger
+static pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool scavenger_running = FALSE;
+
+#ifdef KMA_HUGEPAGES
+// the best backing still worth asking the kernel for
+static kma_backing_t best_backing = PAGE_BACKING_HUGETLB;
+#else
+static kma_backing_t best_backing = PAGE_BACKING_SMALL;
+#endif
 
 /************Function Prototypes******************************************/
-void* allocPage();
+kma_cache_t* myCache();
+void createCacheKey();
+void refillCache(kma_cache_t*);
+void noteIdle();
+void noteReuse();
+void drainCache(kma_cache_t*, int);
+bool depotPush(kma_cache_t*, void*);
+void* depotPop(kma_cache_t*, int);
+int cacheLimit(int);
+void drainDepots(kma_cache_t*);
+void retireCache(void*);
+int reclaimPages(kma_cache_t*, int);
+int shrinkPages(int);
+void throttle(int);
+int poolFree();
+bool poolAllows(int);
+int flushCaches(kma_cache_t*);
+void allocFailed();
+void detectNodes();
+int callerNode();
+void preparePages();
+void* allocPage(int);
+void* allocSpan(int, int);
+void* allocAligned(int, int);
+void placeSpan(int, int);
+void* allocHalf(int);
+void freeHalf(void*);
+void freeSized(kma_page_t*);
+kma_page_t* describePages(void*, int);
+void claimPage(int, int);
 void freePage(void*);
 void initPages();
+void releasePages();
+int mapChunk(int, bool);
+void initChunk(int, bool);
+void warmChunks(int);
+void* warmer(void*);
+int findRun(int, int, int);
+int findAligned(int, int, int);
+void unmapChunk(int);
+void* mmapReserve(kma_page_provider_t*, long*);
+void mmapUnreserve(kma_page_provider_t*, void*, long);
+kma_backing_t mmapCommit(kma_page_provider_t*, void*, long);
+void mmapDecommit(kma_page_provider_t*, void*, long);
+void adviseDiscard(kma_page_provider_t*, void*, long);
+void* staticReserve(kma_page_provider_t*, long*);
+void* fileReserve(kma_page_provider_t*, long*);
+void fileUnreserve(kma_page_provider_t*, void*, long);
+void fileDiscard(kma_page_provider_t*, void*, long);
+void* bufferReserve(kma_page_provider_t*, long*);
+kma_backing_t keepCommit(kma_page_provider_t*, void*, long);
+void keepRange(kma_page_provider_t*, void*, long);
+void keepUnreserve(kma_page_provider_t*, void*, long);
+void populateChunk(void*);
+int residentPages(void*, long);
+void bindChunk(void*, int);
+void addResident(int);
+void releasePage(int, int);
+void releaseNewest();
+void scavengePages(long);
+void* scavenger(void*);
+long nowMs();
+int findFirst(unsigned long*, int, int, bool);
+int findLast(unsigned long*, int);
+
+/************Page Providers***********************************************/
+
+static kma_page_provider_t mmap_provider = { "mmap", mmapReserve,
+					     mmapUnreserve, mmapCommit,
+					     mmapDecommit, adviseDiscard,
+					     NULL, 0, 0 };
+
+static kma_page_provider_t static_provider = { "static", staticReserve,
+					       keepUnreserve, keepCommit,
+					       adviseDiscard, adviseDiscard,
+					       NULL, 0, 0 };
+
+static kma_page_provider_t file_provider = { "file", fileReserve,
+					     fileUnreserve, keepCommit,
+					     fileDiscard, fileDiscard,
+					     NULL, 0, -1 };
+
+static kma_page_provider_t buffer_provider = { "buffer", bufferReserve,
+					       keepUnreserve, keepCommit,
+					       keepRange, keepRange,
+					       NULL, 0, 0 };
+
+static kma_page_provider_t* provider = &mmap_provider;
+
+// one extra chunk leaves room to align the pool
+static char static_pool[(long) STATICPAGES * PAGESIZE + CHUNKSIZE];
 
 /************External Declaration*****************************************/
 
@@ -75,106 +377,2117 @@ void initPages();
 kma_page_t*
 get_page()
 {
-  static int id = 0;
+  kma_cache_t* mine = myCache();
   kma_page_t* res;
+  void* ptr;
+  
+  // only an empty magazine has to go to the shared pool
+  if (mine->count == 0)
+    {
+      refillCache(mine);
+      
+      if (mine->count == 0 && reclaimPages(mine, 1) > 0)
+	{
+	  refillCache(mine);
+	}
+      if (mine->count == 0)
+	{
+	  allocFailed();
+	  return NULL;
+	}
+    }
+  
+  ptr = mine->pages[mine->count - 1];
+  BUMP(mine->count, -1);
+  BUMP(mine->num_requested, 1);
+  BUMP(mine->num_in_use, 1);
   
-  kma_page_stats.num_requested++;
-  kma_page_stats.num_in_use++;
+  if (LOAD(pool_emptied))
+    {
+      pthread_mutex_lock(&page_lock);
+      noteReuse();
+      pthread_mutex_unlock(&page_lock);
+    }
   
-  res = (kma_page_t*) malloc(sizeof(kma_page_t));
-  res->id = id++;
-  res->size = kma_page_stats.page_size;
-  res->ptr = allocPage();
+  assert(ptr != NULL);
   
-  assert(res->ptr != NULL);
+  res = &page_table[PAGEOF(ptr)];
+  res->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+  res->size = PAGESIZE;
+  res->ptr = ptr;
   
   return res;	
 }
 
+kma_page_t*
+get_pages(int n)
+{
+  int node = callerNode();
+  kma_page_t* res = NULL;
+  int tries = 2;
+  void* ptr;
+  
+  assert(n > 0);
+  
+  throttle(n);
+  
+  // the pages reclaimed need not lie next to each other, so one more
+  // try is all there is
+  do
+    {
+      pthread_mutex_lock(&page_lock);
+      
+      preparePages();
+      
+      ptr = allocSpan(n, node);
+      if (ptr != NULL)
+	{
+	  kma_page_stats.num_spans_requested++;
+	  kma_page_stats.num_span_pages += n;
+	  kma_page_stats.num_in_use += n;
+	  
+	  res = describePages(ptr, n);
+	  noteReuse();
+	}
+      
+      pthread_mutex_unlock(&page_lock);
+    }
+  while (res == NULL && --tries > 0 && reclaimPages(myCache(), n) > 0);
+  
+  if (res == NULL)
+    {
+      allocFailed();
+    }
+  
+  return res;
+}
+
+kma_page_t*
+get_page_sized(int size)
+{
+  kma_page_t* res;
+  int tries = 2;
+  void* ptr;
+  int node, n;
+  
+  assert(size >= MINPAGESIZE && size <= MAXPAGESIZE);
+  assert((size & (size - 1)) == 0);
+  
+  if (size == PAGESIZE)
+    {
+      return get_page();
+    }
+  
+  node = callerNode();
+  n = (size < PAGESIZE) ? 1 : size / PAGESIZE;
+  
+  throttle(n);
+  
+  do
+    {
+      pthread_mutex_lock(&page_lock);
+      
+      preparePages();
+      
+      res = NULL;
+      if (size < PAGESIZE)
+	{
+	  ptr = allocHalf(node);
+	  if (ptr != NULL)
+	    {
+	      res = (ptr == BASEADDR(ptr)) ? &page_table[PAGEOF(ptr)]
+		: &half_table[PAGEOF(ptr)];
+	      res->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+	      res->size = size;
+	      res->ptr = ptr;
+	    }
+	}
+      else
+	{
+	  ptr = allocAligned(n, node);
+	  if (ptr != NULL)
+	    {
+	      kma_page_stats.num_in_use += n;
+	      res = describePages(ptr, n);
+	    }
+	}
+      
+      if (res != NULL)
+	{
+	  kma_page_stats.size_requested[SIZECLASS(size)]++;
+	  kma_page_stats.size_in_use[SIZECLASS(size)]++;
+	  noteReuse();
+	}
+      
+      pthread_mutex_unlock(&page_lock);
+    }
+  while (res == NULL && --tries > 0 && reclaimPages(myCache(), n) > 0);
+  
+  if (res == NULL)
+    {
+      allocFailed();
+    }
+  
+  return res;
+}
+
 void
 free_page(kma_page_t* ptr)
 {
+  kma_cache_t* mine = myCache();
+  void* page;
+  
   assert(ptr != NULL);
   assert(ptr->ptr != NULL);
-  assert(kma_page_stats.num_in_use > 0);
+  assert(ptr == page_of(ptr->ptr));
   
-  kma_page_stats.num_freed++;
-  kma_page_stats.num_in_use--;
+  if (ptr->size != PAGESIZE)
+    { // pages of other sizes are not cached
+      freeSized(ptr);
+      return;
+    }
+  
+  page = ptr->ptr;
+  ptr->ptr = NULL;
+  
+  // only a full magazine has to go to the shared pool
+  if (mine->count == MAGAZINE)
+    {
+      drainCache(mine, MAGAZINEBATCH);
+    }
+  
+  mine->pages[mine->count] = page;
+  BUMP(mine->count, 1);
+  BUMP(mine->num_freed, 1);
+  BUMP(mine->num_in_use, -1);
+  
+  // a magazine keeps no more free pages than may be retained
+  if (mine->count > cacheLimit(MAGAZINE))
+    {
+      drainCache(mine, mine->count - cacheLimit(MAGAZINE));
+    }
+  
+  // pages freed by another thread take this count below 0
+  if (mine->num_in_use <= 0)
+    {
+      pthread_mutex_lock(&page_lock);
+      noteIdle();
+      pthread_mutex_unlock(&page_lock);
+    }
+}
+
+void
+free_pages(kma_page_t* ptr)
+{
+  char* page;
+  int i, n;
+  
+  assert(ptr != NULL);
+  assert(ptr->ptr != NULL);
+  assert(ptr == page_of(ptr->ptr));
+  assert(ptr->size >= PAGESIZE && ptr->size % PAGESIZE == 0);
+  
+  pthread_mutex_lock(&page_lock);
+  
+  n = ptr->size / PAGESIZE;
+  page = ptr->ptr;
+  
+  assert(kma_page_stats.num_span_pages >= n);
+  
+  kma_page_stats.num_spans_freed++;
+  kma_page_stats.num_span_pages -= n;
+  kma_page_stats.num_in_use -= n;
+  
+  for (i = 0; i < n; i++)
+    {
+      ptr[i].ptr = NULL;
+    }
+  
+  // the pool is only dropped once the last of these pages is freed
+  for (i = 0; i < n; i++)
+    {
+      freePage(page + i * PAGESIZE);
+    }
+  
+  noteIdle();
+  
+  pthread_mutex_unlock(&page_lock);
+}
+
+kma_page_t*
+page_of(void* ptr)
+{
+  kma_page_t* res;
+  
+  assert(pool != NULL);
+  assert((char*) ptr >= (char*) pool);
+  assert(PAGEOF(ptr) < MAXPAGES);
+  
+  // halves changes under the lock as the other half comes and goes, but
+  // never to 0 while the half ptr lies in is in use
+  if (LOAD(halves[PAGEOF(ptr)]) != 0)
+    { // one of two small pages
+      res = (PAGEBASE(ptr, MINPAGESIZE) == BASEADDR(ptr))
+	? &page_table[PAGEOF(ptr)] : &half_table[PAGEOF(ptr)];
+      
+      assert(res->ptr == PAGEBASE(ptr, MINPAGESIZE));
+      
+      return res;
+    }
+  
+  res = &page_table[PAGEOF(ptr)];
+  
+  if (res->ptr != BASEADDR(ptr))
+    { // inside a span
+      res = &page_table[PAGEOF(res->ptr)];
+    }
+  
+  assert(res->ptr != NULL && res == &page_table[PAGEOF(res->ptr)]);
+  
+  return res;
+}
+
+int
+page_index(void* ptr)
+{
+  assert(pool != NULL);
+  assert((char*) ptr >= (char*) pool);
+  assert(PAGEOF(ptr) < MAXPAGES);
+  
+  return PAGEOF(ptr);
+}
+
+int
+page_colour(void* ptr)
+{
+  int i = PAGEOF(ptr);
   
-  freePage(ptr->ptr);
-  free(ptr);
+  // every page takes the next colour, so that no two neighbouring pages
+  // put their metadata into the same cache sets
+  return (i % PAGECOLOURS) * CACHELINE;
 }
 
 kma_page_stat_t*
 page_stats()
 {
   static kma_page_stat_t stats;
+  kma_cache_t* c;
+  int n;
+  
+  pthread_mutex_lock(&page_lock);
+  
+  memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
+  
+  for (c = caches; c != NULL; c = c->next)
+    {
+      stats.num_requested += LOAD(c->num_requested);
+      stats.num_freed += LOAD(c->num_freed);
+      stats.num_in_use += LOAD(c->num_in_use);
+      stats.num_cached += LOAD(c->count);
+      stats.num_cas += LOAD(c->num_cas);
+      stats.num_cas_retries += LOAD(c->num_cas_retries);
+    }
+  for (n = 0; n < MAXNODES; n++)
+    {
+      stats.num_cached += LOAD(depot_count[n]);
+    }
   
-  return memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
+  // pages of the default size are the ones counted above
+  n = SIZECLASS(PAGESIZE);
+  stats.size_requested[n] = stats.num_requested;
+  stats.size_freed[n] = stats.num_freed;
+  stats.size_in_use[n] = stats.num_requested - stats.num_freed;
+  
+  pthread_mutex_unlock(&page_lock);
+  
+  return &stats;
 }
 
-void*
-allocPage()
+void
+page_retention(int decay, int retained, int background)
 {
-  void* res;
+  pthread_t thread;
   
-  if (pool == NULL)
+  assert(decay > 0 && retained >= 0);
+  
+  pthread_mutex_lock(&page_lock);
+  
+  decay_ms = decay;
+  STORE(max_retained, retained);
+  next_scavenge = 0;
+  
+  while (kma_page_stats.num_retained > max_retained)
     {
-      initPages();
+      releaseNewest();
+    }
+  
+  if (background && !scavenger_running)
+    {
+      if (pthread_create(&thread, NULL, scavenger, NULL) != 0)
+	{
+	  error("Error starting the page scavenger thread", "");
+	}
+      pthread_detach(thread);
+      scavenger_running = TRUE;
     }
   
-  res = next_free_page;
+  pthread_mutex_unlock(&page_lock);
+}
+
+void
+page_numa(int nodes)
+{
+  assert(nodes >= 0 && nodes <= MAXNODES);
+  
+  pthread_once(&topology_once, detectNodes);
   
-  if (res == NULL)
+  pthread_mutex_lock(&page_lock);
+  
+  if (pool != NULL)
     {
-      error("error: all pages already allocated", "");
+      error("Error setting the NUMA topology of a pool in use", "");
     }
   
-  next_free_page = *((void**)next_free_page);
+  if (nodes > 0)
+    {
+      num_nodes = nodes;
+    }
+  else
+    {
+      num_nodes = (real_nodes < MAXNODES) ? real_nodes : MAXNODES;
+    }
   
-  assert(res != NULL);
+  pthread_mutex_unlock(&page_lock);
+}
+
+void
+page_node(int node)
+{
+  assert(node >= -1 && node < MAXNODES);
   
-  return res;
+  my_node = node;
 }
 
 void
-freePage(void* ptr)
+page_warmup(int pages, int background)
 {
-  assert(ptr != NULL);
+  pthread_t thread;
+  
+  assert(pages >= 0);
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  pthread_once(&topology_once, detectNodes);
   
-  if (kma_page_stats.num_in_use == 0)
+  if (!background)
     {
-      free(pool);
-      pool = NULL;
-      next_free_page = NULL;
+      warmChunks(pages);
+      return;
     }
+  
+  if (pthread_create(&thread, NULL, warmer, (void*) (long) pages) != 0)
+    {
+      error("Error starting the page warm-up thread", "");
+    }
+  pthread_detach(thread);
 }
 
 void
-initPages()
+page_provider(kma_page_provider_t* p)
 {
-  int i;
+  pthread_mutex_lock(&page_lock);
   
-  assert(next_free_page == NULL);
-  assert(pool == NULL);
+  if (pool != NULL)
+    {
+      error("Error changing the page provider of a pool in use", "");
+    }
+  
+  provider = (p != NULL) ? p : &mmap_provider;
+  
+  pthread_mutex_unlock(&page_lock);
+}
+
+kma_page_provider_t*
+page_mmap_provider()
+{
+  return &mmap_provider;
+}
+
+kma_page_provider_t*
+page_static_provider()
+{
+  return &static_provider;
+}
+
+kma_page_provider_t*
+page_file_provider(char* path, long size)
+{
+  assert(path != NULL && size > 0);
+  
+  file_provider.arg = path;
+  file_provider.size = size;
   
-  //pool = calloc(MAXPAGES, PAGESIZE);
-  int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
-  if(result)
-    error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
+  return &file_provider;
+}
+
+kma_page_provider_t*
+page_buffer_provider(void* buf, long size)
+{
+  assert(buf != NULL && size > 0);
+  
+  buffer_provider.arg = buf;
+  buffer_provider.size = size;
+  
+  return &buffer_provider;
+}
+
+void
+page_register_shrinker(kma_shrinker_t shrink, void* arg)
+{
+  assert(shrink != NULL);
+  
+  pthread_mutex_lock(&page_lock);
+  
+  if (num_shrinkers == MAXSHRINKERS)
+    {
+      error("Error registering a shrinker: too many shrinkers", "");
+    }
+  
+  shrinkers[num_shrinkers].shrink = shrink;
+  shrinkers[num_shrinkers].arg = arg;
+  num_shrinkers++;
+  
+  pthread_mutex_unlock(&page_lock);
+}
+
+void
+page_unregister_shrinker(kma_shrinker_t shrink, void* arg)
+{
+  int i;
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+  pthread_mutex_lock(&page_lock);
+  
+  for (i = 0; i < num_shrinkers; i++)
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
+      if (shrinkers[i].shrink == shrink && shrinkers[i].arg == arg)
+	{
+	  shrinkers[i] = shrinkers[--num_shrinkers];
+	  break;
+	}
+    }
+  
+  pthread_mutex_unlock(&page_lock);
+}
+
+void
+page_limit(int pages)
+{
+  assert(pages >= 0);
+  
+  pthread_mutex_lock(&page_lock);
+  
+  pool_limit = pages;
+  
+  pthread_mutex_unlock(&page_lock);
+}
+
+void
+page_watermarks(int low, int min)
+{
+  assert(min >= 0 && low >= min);
+  
+  pthread_mutex_lock(&page_lock);
+  
+  watermark_low = low;
+  watermark_min = min;
+  
+  pthread_mutex_unlock(&page_lock);
+}
+
+int
+page_priority(int flags)
+{
+  int old = my_priority;
+  
+  assert((flags & ~(PAGE_HIGH | PAGE_ATOMIC)) == 0);
+  
+  my_priority = flags;
+  
+  return old;
+}
+
+/* the calling thread's magazine, registered on first use */
+kma_cache_t*
+myCache()
+{
+  if (!cache.registered)
+    {
+      pthread_once(&cache_once, createCacheKey);
+      
+      pthread_mutex_lock(&page_lock);
+      cache.next = caches;
+      caches = &cache;
+      pthread_mutex_unlock(&page_lock);
+      
+      // hands the magazine back when the thread exits
+      pthread_setspecific(cache_key, &cache);
+      cache.registered = TRUE;
+    }
+  
+  return &cache;
+}
+
+void
+createCacheKey()
+{
+  if (pthread_key_create(&cache_key, retireCache) != 0)
+    {
+      error("Error creating the page cache key", "");
+    }
+}
+
+void
+refillCache(kma_cache_t* mine)
+{
+  int node = callerNode();
+  int batch;
+  void* page;
+  
+  // the page about to be handed out is not retained, the rest are
+  batch = cacheLimit(MAGAZINEBATCH - 1) + 1;
+  
+  while (mine->count < batch && (page = depotPop(mine, node)) != NULL)
+    {
+      mine->pages[mine->count] = page;
+      BUMP(mine->count, 1);
+    }
+  
+  if (mine->count == batch)
+    {
+      return;
+    }
+  
+  throttle(batch - mine->count);
+  
+  pthread_mutex_lock(&page_lock);
+  
+  preparePages();
+  
+  // a pool running low may fill the magazine only partly, and the
+  // reserve is handed out a page at a time
+  while (mine->count < batch
+	 && (mine->count == 0 || poolFree() > watermark_min)
+	 && (page = allocPage(node)) != NULL)
+    {
+      mine->pages[mine->count] = page;
+      BUMP(mine->count, 1);
+    }
+  
+  pthread_mutex_unlock(&page_lock);
+}
+
+/* the pool ran empty: no page is in use, in any thread or of any size,
+ * though the pool keeps its pages; with the lock held */
+void
+noteIdle()
+{
+  kma_cache_t* c;
+  int in_use = kma_page_stats.num_in_use;
+  
+  for (c = caches; c != NULL && in_use == 0; c = c->next)
+    {
+      in_use += LOAD(c->num_in_use);
+    }
+  
+  if (in_use == 0 && pool != NULL)
+    {
+      STORE(pool_emptied, TRUE);
+    }
+}
+
+/* a page was handed out; if the pool had run empty, its pages were kept
+ * and the pool needed no initialisation. With the lock held. */
+void
+noteReuse()
+{
+  if (pool_emptied)
+    {
+      kma_page_stats.num_inits_avoided++;
+      STORE(pool_emptied, FALSE);
+    }
+}
+
+void
+drainCache(kma_cache_t* mine, int n)
+{
+  assert(n <= mine->count);
+  
+  while (n > 0 && depotPush(mine, mine->pages[mine->count - 1]))
+    {
+      BUMP(mine->count, -1);
+      n--;
+    }
+  
+  if (n == 0)
+    {
+      return;
+    }
+  
+  // the depot is full, the rest goes back to the pool
+  pthread_mutex_lock(&page_lock);
+  
+  while (n-- > 0)
+    {
+      BUMP(mine->count, -1);
+      freePage(mine->pages[mine->count]);
+    }
+  
+  pthread_mutex_unlock(&page_lock);
+}
+
+/* push a page onto the depot of its own node */
+bool
+depotPush(kma_cache_t* mine, void* page)
+{
+  int i = PAGEOF(page);
+  int node = NODEOF(i / CHUNKPAGES);
+  unsigned long old, new;
+  
+  // reserve a slot first so the depot never grows past its limit
+  if (__atomic_add_fetch(&depot_count[node], 1, __ATOMIC_RELAXED)
+      > cacheLimit(DEPOTPAGES))
+    {
+      __atomic_sub_fetch(&depot_count[node], 1, __ATOMIC_RELAXED);
+      return FALSE;
+    }
+  
+  old = __atomic_load_n(&depot_head[node], __ATOMIC_RELAXED);
+  BUMP(mine->num_cas, 1);
+  for (;;)
+    {
+      __atomic_store_n(&depot_next[i], DEPOTINDEX(old), __ATOMIC_RELAXED);
+      new = DEPOTHEAD(old >> 32, i);
+      if (__atomic_compare_exchange_n(&depot_head[node], &old, new, TRUE,
+				      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	{
+	  return TRUE;
+	}
+      BUMP(mine->num_cas_retries, 1);
+    }
+}
+
+void*
+depotPop(kma_cache_t* mine, int node)
+{
+  unsigned long old, new;
+  int i;
+  
+  old = __atomic_load_n(&depot_head[node], __ATOMIC_ACQUIRE);
+  BUMP(mine->num_cas, 1);
+  for (;;)
+    {
+      i = DEPOTINDEX(old);
+      if (i < 0)
+	{
+	  return NULL;
+	}
+      
+      // a stale next is harmless: the tag makes the exchange fail
+      new = DEPOTHEAD(old >> 32,
+		      __atomic_load_n(&depot_next[i], __ATOMIC_RELAXED));
+      if (__atomic_compare_exchange_n(&depot_head[node], &old, new, TRUE,
+				      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+	{
+	  break;
+	}
+      BUMP(mine->num_cas_retries, 1);
+    }
+  
+  __atomic_sub_fetch(&depot_count[node], 1, __ATOMIC_RELAXED);
+  
+  // pages in the depot are claimed, so the pool cannot move under us
+  return (char*)pool + (long)i * PAGESIZE;
+}
+
+/* how many free pages a magazine or depot that holds up to n may keep:
+ * no more than the pool may retain, or they would stay resident past
+ * the retention limit */
+int
+cacheLimit(int n)
+{
+  int retained = LOAD(max_retained);
+  
+  return (retained < n) ? retained : n;
+}
+
+/* hand back to the pool the pages of every depot that has not been
+ * touched since the last call, where they decay like any freed page;
+ * with the lock held */
+void
+drainDepots(kma_cache_t* mine)
+{
+  void* page;
+  int n;
+  
+  for (n = 0; n < MAXNODES; n++)
+    {
+      if (LOAD(depot_head[n]) == depot_seen[n])
+	{
+	  while ((page = depotPop(mine, n)) != NULL)
+	    {
+	      freePage(page);
+	    }
+	}
+      depot_seen[n] = LOAD(depot_head[n]);
+    }
+}
+
+/* an exiting thread returns its pages and leaves its counts behind */
+void
+retireCache(void* arg)
+{
+  kma_cache_t* mine = arg;
+  kma_cache_t** c;
+  
+  if (mine->count > 0)
+    {
+      drainCache(mine, mine->count);
+    }
+  
+  pthread_mutex_lock(&page_lock);
+  
+  for (c = &caches; *c != mine; c = &(*c)->next)
+    {
+      assert(*c != NULL);
+    }
+  *c = mine->next;
+  
+  kma_page_stats.num_requested += mine->num_requested;
+  kma_page_stats.num_freed += mine->num_freed;
+  kma_page_stats.num_in_use += mine->num_in_use;
+  kma_page_stats.num_cas += mine->num_cas;
+  kma_page_stats.num_cas_retries += mine->num_cas_retries;
+  
+  pthread_mutex_unlock(&page_lock);
+  
+  mine->registered = FALSE;
+}
+
+/* the pool is out of pages: ask the shrinkers for the ones they can do
+ * without, and return the cached ones; how many pages came back */
+int
+reclaimPages(kma_cache_t* mine, int wanted)
+{
+  int reclaimed;
+  
+  // atomic allocations may not wait for reclaim, they have the reserve
+  if (my_priority & PAGE_ATOMIC)
+    {
+      return 0;
+    }
+  
+  // the pages the shrinkers free go through this thread's magazine, so
+  // the caches are flushed after them
+  reclaimed = shrinkPages(wanted);
+  reclaimed += flushCaches(mine);
+  
+  return reclaimed;
+}
+
+/* call every shrinker in turn; how many pages they freed */
+int
+shrinkPages(int wanted)
+{
+  static __thread bool reclaiming = FALSE;
+  kma_shrinker_entry_t called[MAXSHRINKERS];
+  int i, n, got, reclaimed = 0;
+  
+  // a shrinker freeing its pages must not end up in here again
+  if (reclaiming)
+    {
+      return 0;
+    }
+  reclaiming = TRUE;
+  
+  pthread_mutex_lock(&page_lock);
+  n = num_shrinkers;
+  memcpy(called, shrinkers, n * sizeof(kma_shrinker_entry_t));
+  pthread_mutex_unlock(&page_lock);
+  
+  for (i = 0; i < n; i++)
+    {
+      got = called[i].shrink(called[i].arg, wanted);
+      assert(got >= 0);
+      
+      pthread_mutex_lock(&page_lock);
+      kma_page_stats.num_shrinks++;
+      kma_page_stats.num_reclaimed += got;
+      pthread_mutex_unlock(&page_lock);
+      
+      reclaimed += got;
+    }
+  
+  reclaiming = FALSE;
+  
+  return reclaimed;
+}
+
+/* give the pages in this thread's magazine and in the depots back to
+ * the pool; the other threads' magazines are out of reach */
+int
+flushCaches(kma_cache_t* mine)
+{
+  void* page;
+  int n, flushed = 0;
+  
+  pthread_mutex_lock(&page_lock);
+  
+  while (mine->count > 0)
+    {
+      BUMP(mine->count, -1);
+      freePage(mine->pages[mine->count]);
+      flushed++;
+    }
+  
+  for (n = 0; n < MAXNODES; n++)
+    {
+      while ((page = depotPop(mine, n)) != NULL)
+	{
+	  freePage(page);
+	  flushed++;
+	}
+    }
+  
+  pthread_mutex_unlock(&page_lock);
+  
+  return flushed;
+}
+
+/* an ordinary allocation that would take the pool below its low
+ * watermark has the shrinkers run first */
+void
+throttle(int n)
+{
+  bool low;
+  
+  if (my_priority != 0)
+    {
+      return;
+    }
+  
+  pthread_mutex_lock(&page_lock);
+  
+  low = poolFree() - n < watermark_low;
+  if (low)
+    {
+      kma_page_stats.num_throttled++;
+    }
+  
+  pthread_mutex_unlock(&page_lock);
+  
+  if (low)
+    {
+      shrinkPages(n);
+    }
+}
+
+/* pages the pool can still hand out, with the lock held */
+int
+poolFree()
+{
+  int pages = pool_chunks * CHUNKPAGES;
+  
+  if (pool_limit > 0 && pool_limit < pages)
+    {
+      pages = pool_limit;
+    }
+  
+  return pages - pool_claimed;
+}
+
+/* whether the caller may take n more pages: ordinary allocations leave
+ * the reserve below the min watermark alone, high-priority ones half of
+ * it, and atomic ones may use it all */
+bool
+poolAllows(int n)
+{
+  int floor = watermark_min;
+  
+  if (my_priority & PAGE_ATOMIC)
+    {
+      floor = 0;
+    }
+  else if (my_priority & PAGE_HIGH)
+    {
+      floor = watermark_min / 2;
+    }
+  
+  return poolFree() - n >= floor;
+}
+
+void
+allocFailed()
+{
+  pthread_mutex_lock(&page_lock);
+  kma_page_stats.num_alloc_failures++;
+  pthread_mutex_unlock(&page_lock);
+}
+
+/* count the machine's nodes; without NUMA there is a single one */
+void
+detectNodes()
+{
+  char path[64];
+  
+  real_nodes = 0;
+  do
+    {
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d",
+	       real_nodes);
+    }
+  while (access(path, F_OK) == 0 && ++real_nodes < 8 * sizeof(long));
+  
+  if (real_nodes == 0)
+    {
+      real_nodes = 1;
+    }
+  
+  num_nodes = (real_nodes < MAXNODES) ? real_nodes : MAXNODES;
+}
+
+/* the node the calling thread prefers to take pages from */
+int
+callerNode()
+{
+  unsigned int cpu, node;
+  
+  pthread_once(&topology_once, detectNodes);
+  
+  if (my_node >= 0)
+    {
+      return my_node % num_nodes;
+    }
+  
+  if (num_nodes == 1 || syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+    {
+      return 0;
+    }
+  
+  // a fake topology spreads the CPUs over its nodes
+  return (num_nodes <= real_nodes) ? node % num_nodes : cpu % num_nodes;
+}
+
+/* map and pre-fault chunks for the given number of pages, spread over
+ * the nodes; the lock is only held per chunk, so pages can be handed
+ * out while a background warm-up is still going */
+void
+warmChunks(int pages)
+{
+  int k, c;
+  
+  for (k = 0; k * CHUNKPAGES < pages; k++)
+    {
+      pthread_mutex_lock(&page_lock);
+      
+      if (pool == NULL)
+	{
+	  initPages();
+	}
+      
+      c = mapChunk(k % num_nodes, TRUE);
+      if (c >= 0)
+	{
+	  kma_page_stats.num_warmed += CHUNKPAGES;
+	}
+      
+      pthread_mutex_unlock(&page_lock);
+    }
+}
+
+void*
+warmer(void* arg)
+{
+  warmChunks((long) arg);
+  
+  return NULL;
+}
+
+/* make sure there is a pool to allocate from */
+void
+preparePages()
+{
+  if (pool == NULL)
+    {
+      initPages();
+    }
+}
+
+void*
+allocPage(int node)
+{
+  kma_chunk_t* chunk;
+  int c = -1, i, n;
+  
+  if (!poolAllows(1))
+    {
+      return NULL;
+    }
+  
+  // only fall back to another node once this one is exhausted
+  for (i = 0; c < 0 && i < num_nodes; i++)
+    {
+      n = (node + i) % num_nodes;
+      
+      // always take from the lowest chunk with free pages, so that the
+      // chunks at the end of the node's range are the first ones to empty
+      c = findFirst(chunk_avail, NODEFIRST(n), node_top[n], TRUE);
+      
+      if (c < 0)
+	{
+	  c = mapChunk(n, FALSE);
+	}
+    }
+  
+  if (c < 0)
+    {
+      return NULL;
+    }
+  if (i > 1)
+    {
+      kma_page_stats.num_fallbacks++;
+    }
+  
+  // and the lowest free page within it; freed pages all lie below top
+  chunk = &chunks[c];
+  i = findFirst(chunk->free_map, 0, chunk->top, TRUE);
+  
+  if (i < 0)
+    {
+      i = chunk->top;
+    }
+  
+  claimPage(c, i);
+  
+  return (char*) CHUNKADDR(c) + i * PAGESIZE;
+}
+
+/* allocate n contiguous pages, which may cross chunk boundaries, and
+ * only cross into other nodes if the node has no room for them; NULL
+ * if there is no room at all */
+void*
+allocSpan(int n, int node)
+{
+  int first;
+  
+  if (!poolAllows(n))
+    {
+      return NULL;
+    }
+  
+  first = findRun(n, NODEFIRST(node) * CHUNKPAGES,
+		  NODEFIRST(node + 1) * CHUNKPAGES);
+  if (first < 0)
+    {
+      first = findRun(n, 0, pool_chunks * CHUNKPAGES);
+      if (first < 0)
+	{
+	  return NULL;
+	}
+      kma_page_stats.num_fallbacks++;
+    }
+  
+  placeSpan(first, n);
+  
+  return (char*) pool + (long) first * PAGESIZE;
+}
+
+/* allocate n contiguous pages aligned to n pages, for a power of two n
+ * no larger than a bitmap word */
+void*
+allocAligned(int n, int node)
+{
+  int first;
+  
+  if (!poolAllows(n))
+    {
+      return NULL;
+    }
+  
+  first = findAligned(n, NODEFIRST(node) * CHUNKPAGES,
+		      NODEFIRST(node + 1) * CHUNKPAGES);
+  if (first < 0)
+    {
+      first = findAligned(n, 0, pool_chunks * CHUNKPAGES);
+      if (first < 0)
+	{
+	  return NULL;
+	}
+      kma_page_stats.num_fallbacks++;
+    }
+  
+  placeSpan(first, n);
+  
+  return (char*) pool + (long) first * PAGESIZE;
+}
+
+/* claim the n pages from page first on, mapping their chunks if need be */
+void
+placeSpan(int first, int n)
+{
+  int c, i;
+  
+  for (c = first / CHUNKPAGES; c <= (first + n - 1) / CHUNKPAGES; c++)
+    {
+      if (!TESTBIT(chunk_mapped, c))
+	{
+	  initChunk(c, FALSE);
+	}
+      if (c >= chunk_top)
+	{
+	  chunk_top = c + 1;
+	}
+      if (c >= node_top[NODEOF(c)])
+	{
+	  node_top[NODEOF(c)] = c + 1;
+	}
+    }
+  
+  for (i = first; i < first + n; i++)
+    {
+      claimPage(i / CHUNKPAGES, i % CHUNKPAGES);
+    }
+}
+
+/* fill in the descriptors of n pages handed out together; the ones
+ * after the first point at the first page */
+kma_page_t*
+describePages(void* ptr, int n)
+{
+  kma_page_t* res = &page_table[PAGEOF(ptr)];
+  int i;
+  
+  res->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+  res->size = n * PAGESIZE;
+  res->ptr = ptr;
+  
+  for (i = 1; i < n; i++)
+    {
+      res[i].id = res->id;
+      res[i].size = 0;
+      res[i].ptr = ptr;
+    }
+  
+  return res;
+}
+
+/* allocate a MINPAGESIZE page, from the lowest split page of the node
+ * with a free half before splitting another page */
+void*
+allocHalf(int node)
+{
+  void* page;
+  int i, h;
+  
+  i = findFirst(half_avail, NODEFIRST(node) * CHUNKPAGES,
+		node_top[node] * CHUNKPAGES, TRUE);
+  if (i < 0)
+    {
+      page = allocPage(node);
+      if (page == NULL)
+	{
+	  return NULL;
+	}
+      i = PAGEOF(page);
+      kma_page_stats.num_in_use++;
+      
+      assert(halves[i] == 0);
+      SETBIT(half_avail, i);
+    }
+  
+  h = (halves[i] & 1) ? 1 : 0;
+  STORE(halves[i], halves[i] | 1 << h);
+  if (halves[i] == 3)
+    {
+      CLEARBIT(half_avail, i);
+    }
+  
+  return (char*) pool + (long) i * PAGESIZE + h * MINPAGESIZE;
+}
+
+/* free a MINPAGESIZE page, and the page it was split from once both of
+ * its halves are free */
+void
+freeHalf(void* ptr)
+{
+  int i = PAGEOF(ptr);
+  int h = (ptr == BASEADDR(ptr)) ? 0 : 1;
+  
+  assert(halves[i] & (1 << h));
+  
+  STORE(halves[i], halves[i] & ~(1 << h));
+  if (halves[i] != 0)
+    {
+      SETBIT(half_avail, i);
+      return;
+    }
+  
+  CLEARBIT(half_avail, i);
+  kma_page_stats.num_in_use--;
+  freePage(BASEADDR(ptr));
+}
+
+void
+freeSized(kma_page_t* ptr)
+{
+  char* page = ptr->ptr;
+  int size = ptr->size;
+  int i, n;
+  
+  assert(size >= MINPAGESIZE && size <= MAXPAGESIZE);
+  
+  pthread_mutex_lock(&page_lock);
+  
+  assert(kma_page_stats.size_in_use[SIZECLASS(size)] > 0);
+  
+  kma_page_stats.size_freed[SIZECLASS(size)]++;
+  kma_page_stats.size_in_use[SIZECLASS(size)]--;
+  
+  ptr->ptr = NULL;
+  
+  if (size < PAGESIZE)
+    {
+      freeHalf(page);
+    }
+  else
+    {
+      n = size / PAGESIZE;
+      kma_page_stats.num_in_use -= n;
+      
+      for (i = 1; i < n; i++)
+	{
+	  ptr[i].ptr = NULL;
+	}
+      for (i = 0; i < n; i++)
+	{
+	  freePage(page + i * PAGESIZE);
+	}
+    }
+  
+  noteIdle();
+  
+  pthread_mutex_unlock(&page_lock);
+}
+
+/* mark a free page of a mapped chunk as in use */
+void
+claimPage(int c, int i)
+{
+  kma_chunk_t* chunk = &chunks[c];
+  bool warm = FALSE;
+  int j;
+  
+  assert(!TESTBIT(page_used, c * CHUNKPAGES + i));
+  
+  if (i >= chunk->top)
+    {
+      if (chunk->pinned)
+	{ // the first touch of what is already resident does not fault;
+	  // a huge page would have faulted once, for the chunk's first page
+	  kma_page_stats.num_faults_avoided +=
+	    (chunk->backing == PAGE_BACKING_SMALL)
+	    ? residentPages((char*) CHUNKADDR(c) + i * PAGESIZE, PAGESIZE)
+	    : (chunk->top == 0) ? residentPages(CHUNKADDR(c), 1) : 0;
+	}
+      
+      // pages a span skipped over become ordinary free pages
+      for (j = chunk->top; j < i; j++)
+	{
+	  SETBIT(chunk->free_map, j);
+	}
+      chunk->top = i + 1;
+    }
+  else
+    {
+      assert(TESTBIT(chunk->free_map, i));
+      CLEARBIT(chunk->free_map, i);
+      
+      if (TESTBIT(chunk->dirty_map, i))
+	{
+	  CLEARBIT(chunk->dirty_map, i);
+	  chunk->num_dirty--;
+	  kma_page_stats.num_retained--;
+	  if (chunk->num_dirty == 0)
+	    {
+	      CLEARBIT(chunk_dirty, c);
+	    }
+	  warm = TRUE;
+	}
+    }
+  
+  SETBIT(page_used, c * CHUNKPAGES + i);
+  chunk->num_in_use++;
+  pool_claimed++;
+  
+  // count each time the free pages drop past a watermark
+  if (poolFree() == watermark_low - 1)
+    {
+      kma_page_stats.num_low_crossings++;
+    }
+  if (poolFree() == watermark_min - 1)
+    {
+      kma_page_stats.num_min_crossings++;
+    }
+  if (poolFree() < watermark_min)
+    {
+      kma_page_stats.num_reserve_pages++;
+    }
+  kma_page_stats.node_pages[NODEOF(c)]++;
+  
+  if (chunk->num_in_use == CHUNKPAGES)
+    {
+      CLEARBIT(chunk_avail, c);
+    }
+  
+  // huge pages and warmed chunks are resident for as long as their
+  // chunk is mapped
+  if (chunk->backing == PAGE_BACKING_SMALL && !chunk->pinned && !warm)
+    {
+      addResident(1);
+    }
+}
+
+void
+freePage(void* ptr)
+{
+  kma_chunk_t* chunk;
+  long now;
+  int c, i;
+  
+  assert(ptr != NULL);
+  assert(ptr == BASEADDR(ptr));
+  
+  c = CHUNKOF(ptr);
+  assert(c >= 0 && c < pool_chunks);
+  
+  chunk = &chunks[c];
+  assert(chunk->num_in_use > 0);
+  
+  i = ((char*) ptr - (char*) CHUNKADDR(c)) / PAGESIZE;
+  
+  assert(TESTBIT(page_used, PAGEOF(ptr)));
+  CLEARBIT(page_used, PAGEOF(ptr));
+  
+  SETBIT(chunk->free_map, i);
+  chunk->num_in_use--;
+  pool_claimed--;
+  kma_page_stats.node_pages[NODEOF(c)]--;
+  SETBIT(chunk_avail, c);
+  
+  if (chunk->pinned)
+    { // warmed pages are never given back
+      return;
+    }
+  
+  if (max_retained == 0)
+    {
+      releasePage(c, i);
+      return;
+    }
+  
+  // keep the page warm for a while, it is likely to be asked for again
+  now = nowMs();
+  
+  SETBIT(chunk->dirty_map, i);
+  chunk->num_dirty++;
+  SETBIT(chunk_dirty, c);
+  dirty_since[PAGEOF(ptr)] = now;
+  kma_page_stats.num_retained++;
+  
+  if (kma_page_stats.num_retained > max_retained)
+    {
+      releaseNewest();
+    }
+  
+  if (now >= next_scavenge)
+    {
+      scavengePages(now);
+    }
+}
+
+void
+initPages()
+{
+  long offset;
+  int n;
+  
+  assert(pool == NULL);
+  assert(kma_page_stats.num_chunks == 0);
+  
+  // only the mmap provider may do better than small pages
+  kma_page_stats.backing = PAGE_BACKING_SMALL;
+  kma_page_stats.provider = provider->name;
+  
+  // room for every chunk the pool may ever grow to; none of it needs to
+  // be backed by memory until its chunk is committed
+  region_size = RESERVESIZE;
+  region = provider->reserve(provider, &region_size);
+  if (region == NULL)
+    {
+      error("Error reserving the page pool with the provider",
+	    provider->name);
+    }
+  
+  // BASEADDR needs every page aligned to PAGESIZE, huge pages need
+  // every chunk aligned to CHUNKSIZE
+  offset = (long) region & (CHUNKSIZE - 1);
+  pool = (char*) region + (offset ? CHUNKSIZE - offset : 0);
+  
+  pool_chunks = (region_size - ((char*) pool - (char*) region)) / CHUNKSIZE;
+  if (pool_chunks > MAXCHUNKS)
+    {
+      pool_chunks = MAXCHUNKS;
+    }
+  if (pool_chunks < 1)
+    {
+      error("Error reserving the page pool: no room for a chunk with",
+	    provider->name);
+    }
+  
+  kma_page_stats.num_inits++;
+  
+  // every chunk was unmapped before the last release, so the chunk
+  // bitmaps are clear already and nothing here depends on MAXPAGES
+  chunk_top = 0;
+  for (n = 0; n < num_nodes; n++)
+    {
+      node_top[n] = NODEFIRST(n);
+    }
+  
+  // a fake topology only splits the pool
+  kma_page_stats.num_nodes = num_nodes;
+  kma_page_stats.nodes_bound = (real_nodes > 1 && num_nodes <= real_nodes);
+}
+
+void
+releasePages()
+{
+  assert(kma_page_stats.num_chunks == 0);
+  
+  provider->unreserve(provider, region, region_size);
+  region = NULL;
+  pool = NULL;
+  
+  // the next page needs a new pool
+  STORE(pool_emptied, FALSE);
+}
+
+/* map a chunk of the node's range, -1 if the node is exhausted; a
+ * pinned chunk is pre-faulted and never unmapped */
+int
+mapChunk(int node, bool pinned)
+{
+  int c;
+  
+  // reuse the lowest unmapped chunk below top before growing the node
+  c = findFirst(chunk_mapped, NODEFIRST(node), node_top[node], FALSE);
+  if (c < 0)
+    {
+      if (node_top[node] >= NODEFIRST(node + 1))
+	{
+	  return -1;
+	}
+      c = node_top[node]++;
+    }
+  
+  if (c >= chunk_top)
+    {
+      chunk_top = c + 1;
+    }
+  
+  initChunk(c, pinned);
+  
+  return c;
+}
+
+void
+initChunk(int c, bool pinned)
+{
+  kma_chunk_t* chunk;
+  void* base;
+  
+  assert(!TESTBIT(chunk_mapped, c));
+  
+  base = CHUNKADDR(c);
+  
+  chunk = &chunks[c];
+  memset(chunk->free_map, 0, sizeof(chunk->free_map));
+  memset(chunk->dirty_map, 0, sizeof(chunk->dirty_map));
+  chunk->top = 0;
+  chunk->num_in_use = 0;
+  chunk->num_dirty = 0;
+  chunk->backing = provider->commit(provider, base, CHUNKSIZE);
+  chunk->pinned = pinned;
+  bindChunk(base, NODEOF(c));
+  
+  // only once it is bound, or the pages land on the wrong node
+  if (pinned)
+    {
+      populateChunk(base);
+    }
+  
+  if (chunk->backing < kma_page_stats.backing)
+    {
+      kma_page_stats.backing = chunk->backing;
+    }
+  
+  if (chunk->backing != PAGE_BACKING_SMALL || pinned)
+    {
+      addResident(CHUNKPAGES);
+    }
+  
+  SETBIT(chunk_mapped, c);
+  SETBIT(chunk_avail, c);
+  
+  kma_page_stats.num_chunks++;
+  kma_page_stats.node_chunks[NODEOF(c)]++;
+  if (kma_page_stats.num_chunks > kma_page_stats.peak_chunks)
+    {
+      kma_page_stats.peak_chunks = kma_page_stats.num_chunks;
+    }
+}
+
+void
+unmapChunk(int c)
+{
+  void* base = CHUNKADDR(c);
+  
+  assert(chunks[c].num_in_use == 0);
+  assert(chunks[c].num_dirty == 0);
+  assert(!chunks[c].pinned);
+  
+  provider->decommit(provider, base, CHUNKSIZE);
+  
+  if (chunks[c].backing != PAGE_BACKING_SMALL)
+    {
+      addResident(-CHUNKPAGES);
+    }
+  
+  CLEARBIT(chunk_mapped, c);
+  CLEARBIT(chunk_avail, c);
+  
+  kma_page_stats.num_chunks--;
+  kma_page_stats.node_chunks[NODEOF(c)]--;
+}
+
+/* give a free page that is still resident back to the kernel, and the
+ * whole chunk once none of its pages are in use or resident any more */
+void
+releasePage(int c, int i)
+{
+  kma_chunk_t* chunk = &chunks[c];
+  void* ptr = (char*) CHUNKADDR(c) + i * PAGESIZE;
+  
+  assert(TESTBIT(chunk->free_map, i));
+  
+  if (TESTBIT(chunk->dirty_map, i))
+    {
+      CLEARBIT(chunk->dirty_map, i);
+      chunk->num_dirty--;
+      kma_page_stats.num_retained--;
+      if (chunk->num_dirty == 0)
+	{
+	  CLEARBIT(chunk_dirty, c);
+	}
+    }
+  
+  if (chunk->backing == PAGE_BACKING_SMALL)
+    {
+      addResident(-1);
+      kma_page_stats.num_released++;
+    }
+  
+  if (chunk->num_in_use == 0 && chunk->num_dirty == 0)
+    {
+      unmapChunk(c);
+      
+      if (kma_page_stats.num_chunks == 0)
+	{
+	  releasePages();
+	}
+    }
+  else if (chunk->backing == PAGE_BACKING_SMALL)
+    { // the page stays mapped and faults in as a zero page on reuse
+      provider->discard(provider, ptr, PAGESIZE);
+    }
+}
+
+/* release the retained page with the highest address: it is the last
+ * one allocPage would reuse */
+void
+releaseNewest()
+{
+  int c = findLast(chunk_dirty, chunk_top);
+  
+  assert(c >= 0);
+  
+  releasePage(c, findLast(chunks[c].dirty_map, CHUNKPAGES));
+}
+
+/* release every retained page that has been idle for the decay time */
+void
+scavengePages(long now)
+{
+  int w, c, i;
+  
+  next_scavenge = now + decay_ms / SCAVENGESTEPS;
+  
+  for (w = 0; w * WORDBITS < chunk_top; w++)
+    {
+      unsigned long cwords = chunk_dirty[w];
+      
+      while (cwords != 0)
+	{
+	  c = w * WORDBITS + __builtin_ctzl(cwords);
+	  cwords &= cwords - 1;
+	  
+	  for (i = 0; i < CHUNKPAGES; i++)
+	    {
+	      if (TESTBIT(chunks[c].dirty_map, i)
+		  && now - dirty_since[c * CHUNKPAGES + i] >= decay_ms)
+		{
+		  releasePage(c, i);
+		  
+		  if (pool == NULL)
+		    { // that was the last page of the pool
+		      return;
+		    }
+		}
+	    }
+	}
+    }
+}
+
+/* background thread returning idle pages while the allocator is idle */
+void*
+scavenger(void* arg)
+{
+  kma_cache_t* mine = myCache();
+  struct timespec delay;
+  int ms;
+  
+  for (;;)
+    {
+      pthread_mutex_lock(&page_lock);
+      if (pool != NULL)
+	{
+	  drainDepots(mine);
+	}
+      if (pool != NULL && kma_page_stats.num_retained > 0)
+	{
+	  scavengePages(nowMs());
+	}
+      ms = decay_ms / SCAVENGESTEPS + 1;
+      pthread_mutex_unlock(&page_lock);
+      
+      delay.tv_sec = ms / 1000;
+      delay.tv_nsec = (ms % 1000) * 1000000L;
+      nanosleep(&delay, NULL);
+    }
+  
+  return NULL;
+}
+
+long
+nowMs()
+{
+  struct timespec now;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+/* address space for the pool; nothing is backed by memory yet */
+void*
+mmapReserve(kma_page_provider_t* self, long* size)
+{
+  void* res = mmap(NULL, *size, PROT_NONE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  
+  if (res == MAP_FAILED)
+    {
+      return NULL;
+    }
+  
+  kma_page_stats.backing = best_backing;
+  
+  return res;
+}
+
+void
+mmapUnreserve(kma_page_provider_t* self, void* base, long size)
+{
+  munmap(base, size);
+}
+
+/* make a reserved chunk accessible, on huge pages if we can get them */
+kma_backing_t
+mmapCommit(kma_page_provider_t* self, void* base, long size)
+{
+  assert(size == CHUNKSIZE);
+  
+#if defined(KMA_HUGEPAGES) && defined(MAP_HUGETLB)
+  if (best_backing == PAGE_BACKING_HUGETLB)
+    {
+      if (mmap(base, CHUNKSIZE, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB,
+	       -1, 0) != MAP_FAILED)
+	{
+	  return PAGE_BACKING_HUGETLB;
+	}
+      // no (more) huge pages reserved in the kernel
+      best_backing = PAGE_BACKING_THP;
+    }
+#endif
+  
+  // a failed MAP_FIXED may already have torn down the reservation, so
+  // map the chunk afresh rather than just changing its protection
+  if (mmap(base, CHUNKSIZE, PROT_READ | PROT_WRITE,
+	   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+    {
+      error("Error using mmap to map a pool chunk", "");
+    }
+  
+#if defined(KMA_HUGEPAGES) && defined(MADV_HUGEPAGE)
+  if (best_backing == PAGE_BACKING_THP)
+    {
+      if (madvise(base, CHUNKSIZE, MADV_HUGEPAGE) == 0)
+	{
+	  return PAGE_BACKING_THP;
+	}
+      // transparent huge pages are disabled
+      best_backing = PAGE_BACKING_SMALL;
+    }
+#endif
+  
+  return PAGE_BACKING_SMALL;
+}
+
+void
+mmapDecommit(kma_page_provider_t* self, void* base, long size)
+{
+  // mapping fresh PROT_NONE pages over the chunk drops its memory
+  if (mmap(base, size, PROT_NONE,
+	   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+	   -1, 0) == MAP_FAILED)
+    {
+      error("Error using mmap to unmap a pool chunk", "");
+    }
+}
+
+/* give the memory of private pages back to the kernel */
+void
+adviseDiscard(kma_page_provider_t* self, void* base, long size)
+{
+  if (madvise(base, size, RELEASE_ADVICE) != 0)
+    {
+      error("Error using madvise to release a page", "");
+    }
+}
+
+void*
+staticReserve(kma_page_provider_t* self, long* size)
+{
+  if (*size > sizeof(static_pool))
+    {
+      *size = sizeof(static_pool);
+    }
+  
+  return static_pool;
+}
+
+/* map the file, grown to the provider's size, as the whole pool */
+void*
+fileReserve(kma_page_provider_t* self, long* size)
+{
+  void* res;
+  
+  if (self->size < *size)
+    {
+      *size = self->size;
+    }
+  
+  self->handle = open(self->arg, O_RDWR | O_CREAT, 0600);
+  if (self->handle < 0)
+    {
+      return NULL;
+    }
+  
+  res = (ftruncate(self->handle, *size) != 0) ? MAP_FAILED
+    : mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	   self->handle, 0);
+  if (res == MAP_FAILED)
+    {
+      close(self->handle);
+      return NULL;
+    }
+  
+  return res;
+}
+
+void
+fileUnreserve(kma_page_provider_t* self, void* base, long size)
+{
+  munmap(base, size);
+  close(self->handle);
+  self->handle = -1;
+}
+
+/* punch the pages out of the file, so they take no disk space */
+void
+fileDiscard(kma_page_provider_t* self, void* base, long size)
+{
+  if (madvise(base, size, MADV_REMOVE) != 0)
+    {
+      error("Error using madvise to release a file page", self->arg);
+    }
+}
+
+void*
+bufferReserve(kma_page_provider_t* self, long* size)
+{
+  if (self->size < *size)
+    {
+      *size = self->size;
+    }
+  
+  return self->arg;
+}
+
+/* memory that is usable all along */
+kma_backing_t
+keepCommit(kma_page_provider_t* self, void* base, long size)
+{
+  return PAGE_BACKING_SMALL;
+}
+
+/* memory that is not ours to drop */
+void
+keepRange(kma_page_provider_t* self, void* base, long size)
+{
+}
+
+void
+keepUnreserve(kma_page_provider_t* self, void* base, long size)
+{
+}
+
+/* how many OS pages of the range mincore finds resident */
+int
+residentPages(void* base, long size)
+{
+  long step = sysconf(_SC_PAGESIZE);
+  unsigned char vec[PAGESIZE / 512];
+  int n, j, res = 0;
+  
+  n = (size + step - 1) / step;
+  assert(n <= (int) sizeof(vec));
+  
+  if (mincore(base, size, vec) != 0)
+    {
+      return 0;
+    }
+  
+  for (j = 0; j < n; j++)
+    {
+      res += vec[j] & 1;
+    }
+  
+  return res;
+}
+
+/* place a freshly mapped chunk on the memory of its node; it has not
+ * been touched yet, so none of it was placed elsewhere */
+void
+bindChunk(void* base, int node)
+{
+  unsigned long mask = 1UL << node;
+  
+  if (!kma_page_stats.nodes_bound)
+    {
+      return;
+    }
+  
+  if (syscall(SYS_mbind, base, (unsigned long) CHUNKSIZE, MPOL_BIND,
+	      &mask, (unsigned long) WORDBITS, 0UL) != 0)
+    { // not allowed to, so the pool carries on unbound
+      kma_page_stats.nodes_bound = FALSE;
+    }
+}
+
+/* fault in every page of a chunk ahead of its first use */
+void
+populateChunk(void* base)
+{
+  long step = sysconf(_SC_PAGESIZE);
+  char* p;
+  
+#ifdef MADV_POPULATE_WRITE
+  if (madvise(base, CHUNKSIZE, MADV_POPULATE_WRITE) == 0)
+    {
+      return;
+    }
+#endif
+  
+  // older kernels: write-fault each page, it only holds zeroes yet
+  for (p = base; p < (char*) base + CHUNKSIZE; p += step)
+    {
+      *(volatile char*) p = 0;
+    }
+}
+
+void
+addResident(int pages)
+{
+  kma_page_stats.num_resident += pages;
+  if (kma_page_stats.num_resident > kma_page_stats.peak_resident)
+    {
+      kma_page_stats.peak_resident = kma_page_stats.num_resident;
+    }
+}
+
+/* index of the first set (or clear) bit of a bitmap from bit first up
+ * to bit last, -1 if there is none */
+int
+findFirst(unsigned long* map, int first, int last, bool set)
+{
+  int i;
+  
+  for (i = first / WORDBITS; i * WORDBITS < last; i++)
+    {
+      unsigned long word = set ? map[i] : ~map[i];
+      
+      if (i == first / WORDBITS)
+	{ // ignore the bits before first
+	  word &= ~0UL << (first % WORDBITS);
+	}
+      
+      if (word != 0)
+	{
+	  int bit = i * WORDBITS + __builtin_ctzl(word);
+	  
+	  return (bit < last) ? bit : -1;
+	}
+    }
+  
+  return -1;
+}
+
+/* first page of the lowest run of n pages between pages first and last
+ * that are not in use, -1 if there is no such run; pages in unmapped
+ * chunks count as free */
+int
+findRun(int n, int first, int last)
+{
+  int i = first, start = first, run = 0;
+  
+  while (i < last)
+    {
+      unsigned long word = page_used[i / WORDBITS];
+      
+      if (i % WORDBITS == 0 && (word == 0 || word == ~0UL))
+	{ // skip whole words at a time
+	  if (word != 0)
+	    {
+	      run = 0;
+	    }
+	  else
+	    {
+	      if (run == 0)
+		{
+		  start = i;
+		}
+	      run += WORDBITS;
+	    }
+	  i += WORDBITS;
+	}
+      else
+	{
+	  if ((word >> (i % WORDBITS)) & 1)
+	    {
+	      run = 0;
+	    }
+	  else
+	    {
+	      if (run == 0)
+		{
+		  start = i;
+		}
+	      run++;
+	    }
+	  i++;
+	}
+      
+      if (run >= n)
+	{
+	  return (start + n <= last) ? start : -1;
+	}
+    }
+  
+  return -1;
+}
+
+/* first page of the lowest free run of n pages between pages first and
+ * last that is aligned to n pages, -1 if there is none; n is a power of
+ * two no larger than a bitmap word, so a run never straddles two words */
+int
+findAligned(int n, int first, int last)
+{
+  unsigned long mask = (n == WORDBITS) ? ~0UL : (1UL << n) - 1;
+  int w, k;
+  
+  assert(n > 0 && n <= WORDBITS && (n & (n - 1)) == 0);
+  
+  for (w = first / WORDBITS; w * WORDBITS < last; w++)
+    {
+      unsigned long word = page_used[w];
+      
+      if (word == ~0UL)
+	{ // skip whole words at a time
+	  continue;
+	}
+      
+      for (k = 0; k < WORDBITS; k += n)
+	{
+	  if (((word >> k) & mask) == 0)
+	    {
+	      return w * WORDBITS + k;
+	    }
+	}
+    }
+  
+  return -1;
+}
+
+/* index of the last set bit among the first nbits of a bitmap, -1 if
+ * there is none */
+int
+findLast(unsigned long* map, int nbits)
+{
+  int i;
+  
+  for (i = (nbits - 1) / WORDBITS; i >= 0; i--)
+    {
+      unsigned long word = map[i];
+      
+      if ((i + 1) * WORDBITS > nbits)
+	{ // ignore the bits past nbits
+	  word &= (1UL << (nbits % WORDBITS)) - 1;
+	}
       
-      *((void**) ptr) = next;
+      if (word != 0)
+	{
+	  return i * WORDBITS + (WORDBITS - 1 - __builtin_clzl(word));
+	}
     }
   
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+  return -1;
 }
@@ -64,7 +64,62 @@
 
 #define PAGESIZE 8192
 
-#define MAXPAGES 4096
+/* get_page_sized also serves every power of two from MINPAGESIZE to
+ * MAXPAGESIZE; a page of any size is aligned to its size */
+#define MINPAGESIZE (PAGESIZE / 2)
+
+#define MAXPAGESIZE (8 * PAGESIZE)
+
+#define NUMPAGESIZES 5
+
+/* Metadata at the same offset of every page lands in the same few cache
+ * sets; page_colour staggers it over PAGECOLOURS cache lines instead.
+ * MAXCOLOUR is the largest offset it returns. */
+#define CACHELINE 64
+
+#define PAGECOLOURS 8
+
+#define MAXCOLOUR ((PAGECOLOURS - 1) * CACHELINE)
+
+/* The pool is reserved as one address range but only mapped in chunks
+ * of CHUNKPAGES pages as they are needed. MAXPAGES just bounds the
+ * reservation; unmapped chunks cost no memory. Built with
+ * -DKMA_HUGEPAGES every chunk is one 2 MB huge page. */
+#ifdef KMA_HUGEPAGES
+#define HUGEPAGESIZE (2 * 1024 * 1024)
+
+#define CHUNKPAGES (HUGEPAGESIZE / PAGESIZE)
+
+#define MAXCHUNKS 256
+#else
+#define CHUNKPAGES 64
+
+#define MAXCHUNKS 1024
+#endif
+
+#define MAXPAGES (CHUNKPAGES * MAXCHUNKS)
+
+/* By default a freed page stays resident for DECAYMS milliseconds, and
+ * at most RETAINPAGES freed pages do, before they go back to the kernel
+ * (see page_retention). */
+#define DECAYMS 1000
+
+#define RETAINPAGES (4 * CHUNKPAGES)
+
+/* The chunks are split into one contiguous range per NUMA node, for at
+ * most MAXNODES nodes (see page_numa). */
+#define MAXNODES 4
+
+/* pages in the array of the static page provider */
+#define STATICPAGES (MAXPAGES / 8)
+
+/* at most MAXSHRINKERS backends can register a shrinker at once */
+#define MAXSHRINKERS 8
+
+/* allocation priorities for page_priority */
+#define PAGE_HIGH 1
+
+#define PAGE_ATOMIC 2
 
 /***********************************************************************
  *  Title: Base Address Macro
@@ -76,6 +131,16 @@
  ***********************************************************************/
 #define BASEADDR(x) ((void*)(((long) (x)) & ~(PAGESIZE-1)))
 
+/***********************************************************************
+ *  Title: Sized Base Address Macro
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the start of the page of the given size that
+ *             contains a pointer
+ *    Input: pointer, page size
+ *    Output: the base address of the page
+ ***********************************************************************/
+#define PAGEBASE(x, size) ((void*)(((long) (x)) & ~((long) (size) - 1)))
+
 typedef struct
 {
   int id;
@@ -83,14 +148,80 @@ typedef struct
   int size;
 } kma_page_t;
 
+/* what the pool memory is backed by, weakest first */
+typedef enum
+{
+  PAGE_BACKING_SMALL,
+  PAGE_BACKING_THP,
+  PAGE_BACKING_HUGETLB
+} kma_backing_t;
+
 typedef struct
 {
   int num_requested;
   int num_freed;
   int num_in_use;
   int page_size;
+  int num_chunks;
+  int peak_chunks;
+  int num_resident;
+  int peak_resident;
+  int num_released;
+  kma_backing_t backing;
+  int num_retained;
+  int num_inits;
+  int num_inits_avoided;
+  int num_spans_requested;
+  int num_spans_freed;
+  int num_span_pages;
+  int num_cached;
+  long num_cas;
+  long num_cas_retries;
+  int num_nodes;
+  int nodes_bound;
+  int num_fallbacks;
+  int node_pages[MAXNODES];
+  int node_chunks[MAXNODES];
+  int size_requested[NUMPAGESIZES];
+  int size_freed[NUMPAGESIZES];
+  int size_in_use[NUMPAGESIZES];
+  int num_warmed;
+  int num_faults_avoided;
+  int num_shrinks;
+  int num_reclaimed;
+  int num_alloc_failures;
+  int num_low_crossings;
+  int num_min_crossings;
+  int num_reserve_pages;
+  int num_throttled;
+  char* provider;
 } kma_page_stat_t;
 
+/* Where the pool gets its memory from. reserve hands out one address
+ * range for the whole pool: it is asked for *size bytes and may give
+ * fewer, setting *size; NULL if it has none. commit makes a chunk of it
+ * usable before pages are handed out, decommit gives a chunk back once
+ * none of its pages are in use any more, and discard drops the contents
+ * of free pages. unreserve returns the range once the pool is empty. */
+typedef struct kma_page_provider
+{
+  char* name;
+  void* (*reserve)(struct kma_page_provider*, long*);
+  void (*unreserve)(struct kma_page_provider*, void*, long);
+  kma_backing_t (*commit)(struct kma_page_provider*, void*, long);
+  void (*decommit)(struct kma_page_provider*, void*, long);
+  void (*discard)(struct kma_page_provider*, void*, long);
+  void* arg;
+  long size;
+  long handle;
+} kma_page_provider_t;
+
+/* Called when the pool runs out of pages, without any lock of the pool
+ * held, with the argument it was registered with and the number of
+ * pages wanted. It frees what pages it can do without (it must not
+ * allocate any) and returns how many it freed. */
+typedef int (*kma_shrinker_t)(void*, int);
+
 /************Global Variables*********************************************/
 
 /************Function Prototypes******************************************/
@@ -100,19 +231,71 @@ typedef struct
  * ---------------------------------------------------------------------
  *    Purpose: Allocates a memory page
  *    Input: none
- *    Output: the allocated memory page
+ *    Output: the allocated memory page, NULL if the pool is exhausted
+ *            even after the shrinkers ran
  ***********************************************************************/
 EXTERN kma_page_t* get_page();
 
+/***********************************************************************
+ *  Title: Allocates a memory page of a given size
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates a memory page of any power of two size from
+ *             MINPAGESIZE to MAXPAGESIZE, aligned to its size
+ *    Input: the page size
+ *    Output: the allocated memory page, NULL if the pool is exhausted
+ ***********************************************************************/
+EXTERN kma_page_t* get_page_sized(int);
+
 /***********************************************************************
  *  Title: Releases a memory page 
  * ---------------------------------------------------------------------
- *    Purpose: Releases a memory page
+ *    Purpose: Releases a memory page from get_page or get_page_sized
  *    Input: the pointer to the memory page structure
  *    Output: none
  ***********************************************************************/
 EXTERN void free_page(kma_page_t*);
 
+/***********************************************************************
+ *  Title: Allocates contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates a span of n pages at consecutive addresses
+ *    Input: the number of pages
+ *    Output: the memory page structure of the first page, whose size
+ *            covers the whole span; NULL if there is no room for it
+ ***********************************************************************/
+EXTERN kma_page_t* get_pages(int);
+
+/***********************************************************************
+ *  Title: Releases contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases a span allocated by get_pages
+ *    Input: the memory page structure of the span
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages(kma_page_t*);
+
+/***********************************************************************
+ *  Title: Finds the page of an address
+ * ---------------------------------------------------------------------
+ *    Purpose: Looks up the memory page structure of the page (or
+ *             span) that contains an address, in constant time
+ *    Input: any address within an allocated memory page
+ *    Output: the memory page structure returned by get_page or
+ *            get_pages
+ ***********************************************************************/
+EXTERN kma_page_t* page_of(void*);
+
+/***********************************************************************
+ *  Title: Page number
+ * ---------------------------------------------------------------------
+ *    Purpose: Numbers the page an address lies in from the start of
+ *             the pool, so that an allocator can keep a table with an
+ *             entry per page
+ *    Input: any address within an allocated memory page
+ *    Output: the page number, from 0 to MAXPAGES - 1
+ ***********************************************************************/
+EXTERN int page_index(void*);
+
 /***********************************************************************
  *  Title: Memory page statistics
  * ---------------------------------------------------------------------
@@ -122,6 +305,148 @@ EXTERN void free_page(kma_page_t*);
  ***********************************************************************/
 EXTERN kma_page_stat_t* page_stats();
 
+/***********************************************************************
+ *  Title: Page colour
+ * ---------------------------------------------------------------------
+ *    Purpose: Gives the offset at which to keep the metadata or the
+ *             first object of a page, so that those of neighbouring
+ *             pages fall into different cache sets
+ *    Input: any address within an allocated memory page
+ *    Output: a multiple of CACHELINE from 0 to MAXCOLOUR
+ ***********************************************************************/
+EXTERN int page_colour(void*);
+
+/***********************************************************************
+ *  Title: Page retention policy
+ * ---------------------------------------------------------------------
+ *    Purpose: Sets how long freed pages are kept resident before they
+ *             are returned to the operating system. No thread's page
+ *             cache and no node's depot holds more free pages than
+ *             that many either, and the background thread also empties
+ *             depots that went untouched for a scavenging period into
+ *             the pool, where their pages decay.
+ *    Input: the decay time in milliseconds, the most freed pages kept
+ *           resident (0 returns pages as soon as they are freed),
+ *           whether a background thread should return idle pages
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_retention(int, int, int);
+
+/***********************************************************************
+ *  Title: NUMA topology
+ * ---------------------------------------------------------------------
+ *    Purpose: Splits the pool into one sub-pool per node. Must be
+ *             called before the first page is allocated. With more
+ *             nodes than the machine has the topology is faked: the
+ *             pool is split, but not bound to real nodes.
+ *    Input: the number of nodes, 0 for the machine's own
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_numa(int);
+
+/***********************************************************************
+ *  Title: Preferred node
+ * ---------------------------------------------------------------------
+ *    Purpose: Sets the node the calling thread takes pages from first
+ *    Input: the node, -1 for the node the thread is running on
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_node(int);
+
+/***********************************************************************
+ *  Title: Page warm-up
+ * ---------------------------------------------------------------------
+ *    Purpose: Maps and pre-faults enough chunks for the given number
+ *             of pages, so that handing them out never takes a page
+ *             fault. Warmed chunks stay resident for good.
+ *    Input: the number of pages, whether to warm them up from a
+ *           background thread instead of before returning
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_warmup(int, int);
+
+/***********************************************************************
+ *  Title: Page provider
+ * ---------------------------------------------------------------------
+ *    Purpose: Selects where the pool gets its memory from. Must be
+ *             called before the first page is allocated; the provider
+ *             must stay valid for as long as the pool uses it.
+ *    Input: the provider, NULL for the default one (page_mmap_provider)
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_provider(kma_page_provider_t*);
+
+/***********************************************************************
+ *  Title: Built-in page providers
+ * ---------------------------------------------------------------------
+ *    Purpose: page_mmap_provider reserves address space and maps it a
+ *             chunk at a time (on huge pages if built for them).
+ *             page_static_provider uses a fixed array of STATICPAGES
+ *             pages. page_file_provider maps size bytes of a file,
+ *             and page_buffer_provider uses memory the caller owns,
+ *             which it never discards. There is one instance of each,
+ *             so calling a constructor again reconfigures it.
+ *    Input: the file to map, or the buffer; and their size in bytes
+ *    Output: the provider, for page_provider
+ ***********************************************************************/
+EXTERN kma_page_provider_t* page_mmap_provider();
+
+EXTERN kma_page_provider_t* page_static_provider();
+
+EXTERN kma_page_provider_t* page_file_provider(char*, long);
+
+EXTERN kma_page_provider_t* page_buffer_provider(void*, long);
+
+/***********************************************************************
+ *  Title: Shrinkers
+ * ---------------------------------------------------------------------
+ *    Purpose: Registers a function that gives free pages a backend
+ *             holds on to back to the pool when it runs out (see
+ *             kma_shrinker_t), or unregisters it again. Allocations only
+ *             fail once every shrinker had its turn.
+ *    Input: the shrinker and the argument to call it with
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_register_shrinker(kma_shrinker_t, void*);
+
+EXTERN void page_unregister_shrinker(kma_shrinker_t, void*);
+
+/***********************************************************************
+ *  Title: Pool limit
+ * ---------------------------------------------------------------------
+ *    Purpose: Caps the number of pages taken from the pool at once,
+ *             counting those cached for reuse, so that running out of
+ *             memory can be tried without using it all up
+ *    Input: the most pages, 0 for no limit
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_limit(int);
+
+/***********************************************************************
+ *  Title: Pool watermarks
+ * ---------------------------------------------------------------------
+ *    Purpose: Sets how many free pages of the pool are kept back. Below
+ *             the low watermark ordinary allocations have the shrinkers
+ *             run first; below the min watermark they fail, and the
+ *             reserve left is for high-priority allocations (down to
+ *             half of it) and atomic ones (all of it). Both are 0
+ *             until this is called, so no pages are kept back.
+ *    Input: the low and the min watermark, in pages
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_watermarks(int, int);
+
+/***********************************************************************
+ *  Title: Allocation priority
+ * ---------------------------------------------------------------------
+ *    Purpose: Sets the priority of the calling thread's allocations
+ *             until it is set again. Atomic allocations never wait for
+ *             the shrinkers.
+ *    Input: PAGE_HIGH and/or PAGE_ATOMIC, 0 for an ordinary allocation
+ *    Output: the priority it had before
+ ***********************************************************************/
+EXTERN int page_priority(int);
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
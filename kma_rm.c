@@ -50,325 +50,191 @@
  *  variables should be in all lower case. When initializing
  *  structures and arrays, line everything up in neat columns.
  */
-// static unsigned int firstbase = 0;
-// #define PAGEBASE(id) ((void*)(firstbase+PAGESIZE*id))
 
+// every hole is described by a resourceEntry stored in the hole itself
 typedef struct resourceHead {
-	int base;
+	void* base;
 	int size;
 	struct resourceHead * next;
 } resourceEntry;
 
+// a freed block must be able to hold its entry, and entries stay aligned
+#define MIN_SIZE ((int)sizeof(resourceEntry))
+#define ALIGN(x) (((x) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
 /************Global Variables*********************************************/
-kma_page_t* g_resource_map = NULL;
+// holes of all pages, sorted by address
+resourceEntry* g_resource_map = NULL;
 
 /************Function Prototypes******************************************/
-static bool coalesce();
+static int round_size(kma_size_t);
+static bool coalesce(resourceEntry*);
 //static void printResources(char *);
 
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 
+/*
+Pages carry no header: free_page gets the page structure back from
+page_of, so all PAGESIZE bytes of a page can be handed out. The list
+only holds holes, in address order, so holes on the same page are
+neighbours in the list and can be merged with them.
+*/
 
 void* kma_malloc(kma_size_t malloc_size){
-	if (g_resource_map == NULL)
-	{
-		// if the request is larger than the size of a page we can't allocate it
-		if (malloc_size >= (PAGESIZE - sizeof(kma_page_t*))){return NULL;}
-		kma_page_t* first = get_page();
-		// safely corrects the ptr, in case get_page does not return the actual base
-		if(first->ptr != BASEADDR(first->ptr)){ first->ptr = BASEADDR(first->id);}
-		void* allocated = (void*)((unsigned int)first->ptr + sizeof(kma_page_t*));
-		g_resource_map = first;
-		g_resource_map->ptr =(void*)((unsigned int)first->ptr + sizeof(kma_page_t*) + malloc_size);
-		resourceEntry* newEntry = g_resource_map->ptr;
-		newEntry->size = PAGESIZE - sizeof(kma_page_t*) - malloc_size;
-		newEntry->base = (int)g_resource_map->ptr;
-		newEntry->next = NULL;
-		return allocated;
+	// requests larger than a page get contiguous pages of their own
+	if (malloc_size > PAGESIZE){
+		kma_page_t* pages = get_pages((malloc_size + PAGESIZE - 1) / PAGESIZE);
+		return (pages == NULL) ? NULL : pages->ptr;
 	}
-	resourceEntry* entry = (resourceEntry*)g_resource_map;
+	int size = round_size(malloc_size);
+	resourceEntry* entry = g_resource_map;
 	resourceEntry* prev = NULL;
+	//first fit, but never leave a rest too small to hold an entry
 	while(entry!=NULL){
-		//is this a kma_page_t*
-		if(((kma_page_t*)entry)->size==PAGESIZE){
-			prev = entry;
-			entry=((kma_page_t*)entry)->ptr;
-		}
-		//entry is not a kma_page_t*, so check for size of hole
-		else if(entry->size<PAGESIZE){
-			if (malloc_size < 12){
-				malloc_size = 12;
-			}
-			//found big enough hole
-			if(malloc_size <= (entry->size-12)){
-				break;
-			}
-			prev = entry;
-			entry=entry->next;
-		}
-		else{
-			printf("hard else  size:%d\n",entry->size);
-			exit(EXIT_FAILURE);
-			entry = NULL;
+		if(entry->size == size || entry->size >= size + MIN_SIZE){
+			break;
 		}
+		prev = entry;
+		entry = entry->next;
 	}
-	//no hole big enough
-	if(entry==NULL)
-	{
-		bool coalesced = FALSE;
-		//attempt to merge holes, if any were merged, coalesced==TRUE
-		while(coalesce()){
-			coalesced = TRUE;
+	//no hole big enough, so add a new page as one big hole
+	if(entry==NULL){
+		kma_page_t* newpage = get_page();
+		//the pool is exhausted
+		if(newpage==NULL){
+			return NULL;
+		}
+		entry = newpage->ptr;
+		entry->base = newpage->ptr;
+		entry->size = PAGESIZE;
+		//link it in sorted by address
+		prev = NULL;
+		resourceEntry* next = g_resource_map;
+		while(next!=NULL && next->base < entry->base){
+			prev = next;
+			next = next->next;
 		}
-		if (coalesced){
-			return kma_malloc(malloc_size);
+		entry->next = next;
+		if(prev==NULL){
+			g_resource_map = entry;
 		}
-		//still can’t place it. create new page
 		else{
-			// if the request is larger than the size of a page we can't allocate it
-			if (malloc_size >= (PAGESIZE - sizeof(kma_page_t*))){return NULL;}
-			kma_page_t* newpage = get_page();
-			//need to correct the ptr, in case it returned a bad ptr.
-			if(newpage->ptr != BASEADDR(newpage->ptr)){ newpage->ptr = BASEADDR(newpage->ptr); }
-			void* ptr = newpage->ptr + sizeof(kma_page_t*);
-			newpage->ptr = (resourceEntry*)((unsigned int)newpage->ptr + sizeof(kma_page_t*) + malloc_size);
-			resourceEntry* newentry = newpage->ptr;
-			//if there is not enough remaining free space to even store an entry, 
-			//you need to delete this entry and link up the free list appropriately
-			if((PAGESIZE - sizeof(kma_page_t*) - malloc_size)<sizeof(resourceEntry)){
-				//link up previous entry to next entry
-				//if prev is a kma_page_t* access appropriately
-				if(((kma_page_t*)prev)->size==PAGESIZE){
-					((kma_page_t*)prev)->ptr = newpage;
-					newpage->ptr = NULL;
-				}
-				else{
-					prev->next = (resourceEntry*)newpage;
-					newpage->ptr = NULL;
-				}
-			}
-			else{
-				newentry->size = PAGESIZE - sizeof(kma_page_t*) - malloc_size;
-				newentry->base = (unsigned int)newpage->ptr;
-				newentry->next = NULL;
-				//link up list correctly
-				if(prev!=NULL){
-					if(((kma_page_t*)prev)->size==PAGESIZE){
-						((kma_page_t*)prev)->ptr = newpage;
-					}
-					else{
-						prev->next = (resourceEntry*)newpage;
-					}	
-				}
-				//set resource_map
-				else{
-					g_resource_map->ptr = newpage;
-				}
-			}
-			return ptr;
+			prev->next = entry;
 		}
 	}
-	else // updating entry to reflect the remaining free space on the page
-	{
-		void* ptr = (void*)entry->base;
-		resourceEntry * next = entry->next;
-		int size = entry->size;
-		int newsize = entry->size - malloc_size;
-		// not enough room for a resource entry
-		if (newsize < sizeof(resourceEntry)){
-			//nothing before it on the list to link up
-			if(prev==NULL){
-				g_resource_map->ptr = next;
-			}
-			//link up previous entry to next entry
-			else{
-				//previous was a kma_page_t* so access appropriately
-				if(((kma_page_t*)prev)->size==PAGESIZE){
-					((kma_page_t*)prev)->ptr = next;
-				}
-				else{
-					prev->next = next;
-				}
-				entry = NULL;
-			}
+	void* ptr = entry->base;
+	resourceEntry* next = entry->next;
+	//the whole hole is used up, or what is left could not hold an entry,
+	//so unlink the entry
+	if(entry->size - size < MIN_SIZE){
+		if(prev==NULL){
+			g_resource_map = next;
 		}
 		else{
-			// we have enough room, so update the values
-			entry = (resourceEntry*)(entry->base + malloc_size);
-			entry->base = (int)entry;
-			entry->size = size - malloc_size;
-			entry->next = next;
-			if (prev==NULL){
-				g_resource_map->ptr = entry;
-			}
-			else{
-				if(((kma_page_t*)prev)->size==PAGESIZE){
-					((kma_page_t*)prev)->ptr = entry;
-				}
-				else{
-					prev->next = entry;
-				}
-			}
+			prev->next = next;
 		}
 		return ptr;
 	}
-}
-
-//coalesce forward, adjacent resourceEntries to items on the same physical page
-static bool coalesce(){
-	bool result = FALSE;
-	resourceEntry* current = (resourceEntry*)g_resource_map;
-	kma_page_t* recentHead = NULL;
-	resourceEntry* prev = NULL;
-	while(current!=NULL){
-		//is this a kma_page_t*? if so move on
-		if(((kma_page_t*)current)->size==PAGESIZE){
-			recentHead = (kma_page_t*)current;
-			current = ((kma_page_t*)current)->ptr;
-		}
-		// is the block a fully free page that we should free?
-		else if(current->size == (PAGESIZE - sizeof(kma_page_t*))){
-			//are we freeing the resource map?
-			if(recentHead==g_resource_map){
-				g_resource_map = (kma_page_t*)current->next;
-			}
-			else{
-				if(prev!=NULL){
-					if(((kma_page_t*)prev)->size==PAGESIZE){
-						((kma_page_t*)prev)->ptr = current->next;
-					}
-					else{
-						prev->next = current->next;
-					}
-				}
-			}
-			current = current->next;
-			free_page(recentHead);
-		}
-		//is this block directly adjacent to the next block? and on the same page?
-		else if(current->next!=NULL &&
-				!(((kma_page_t*)(current->next))->size==PAGESIZE) && 
-				(current->base+current->size)==current->next->base &&
-				BASEADDR(current)==BASEADDR(current->next)){
-			result = TRUE;
-			prev = current;
-			current->size+=current->next->size;
-			current->next=current->next->next;
-			current = current->next;
-		}
-		else{
-			prev = current;
-			current = current->next;
-		}
+	// we have enough room, so move the entry behind the allocated block
+	int remaining = entry->size - size;
+	entry = (resourceEntry*)((char*)ptr + size);
+	entry->base = entry;
+	entry->size = remaining;
+	entry->next = next;
+	if(prev==NULL){
+		g_resource_map = entry;
 	}
-	return result;
+	else{
+		prev->next = entry;
+	}
+	return ptr;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-	while(coalesce()){};
-	if(size<12){size = 12;}
+	if (size > PAGESIZE){
+		free_pages(page_of(ptr));
+		return;
+	}
 	resourceEntry* newentry = ptr;
-	newentry->base = (int)ptr;
-	newentry->size = size;
-	kma_page_t* thepage = BASEADDR(ptr);
-	resourceEntry* entry = (resourceEntry*)g_resource_map;
+	newentry->base = ptr;
+	newentry->size = round_size(size);
+	resourceEntry* entry = g_resource_map;
 	resourceEntry* prev = NULL;
-	bool foundpage = FALSE;
-	while(entry!=NULL){
-		//haven't found page yet?
-		if(foundpage == FALSE){
-			prev = entry;
-			//is this a kma_page_t*?
-			if(((kma_page_t*)entry)->size==PAGESIZE){
-				//is this the matching page?
-				if(thepage==BASEADDR(((kma_page_t*)entry)->ptr)){
-					//we found the right page, so link appropriately from here
-					foundpage = TRUE;
-				}
-				entry = ((kma_page_t*)entry)->ptr;
-			}
-			//this is a resourceEntry
-			else{
-				entry = entry->next;
-			}
+	//find the place to link in, sorted by address
+	while(entry!=NULL && entry->base < newentry->base){
+		prev = entry;
+		entry = entry->next;
+	}
+	newentry->next = entry;
+	if(prev==NULL){
+		g_resource_map = newentry;
+	}
+	else{
+		prev->next = newentry;
+	}
+	//merge with the hole behind it, then with the one in front of it
+	coalesce(newentry);
+	if(prev!=NULL && coalesce(prev)){
+		newentry = prev;
+	}
+	//a hole covering a whole page gives the page back
+	if(newentry->size == PAGESIZE){
+		if(g_resource_map==newentry){
+			g_resource_map = newentry->next;
 		}
-		//Found the correct page
-		if(foundpage==TRUE) {
-			//found the next kma_page_t*, so link prev to newentry to entry
-			if(((kma_page_t*)entry)->size==PAGESIZE){
-				//prev page cannot be null, so is it a page?
-				if(((kma_page_t*)prev)->size==PAGESIZE){
-					((kma_page_t*)prev)->ptr = newentry;
-				}
-				//prev is an entry
-				else{
-					prev->next = newentry;
-				}
-				newentry->next = entry;
-				while(coalesce()){};
-				return;
-			}
-			//is this entry's base larger than ptr? if so we link here
-			else if(entry->base>newentry->base){
-				if(((kma_page_t*)prev)->size==PAGESIZE){
-					((kma_page_t*)prev)->ptr = newentry;
-				}
-				//prev is an entry
-				else{
-					prev->next = newentry;
-				}
-				newentry->next = entry;
-				while(coalesce()){};
-				return;
+		else{
+			//prev is the entry before newentry, unless we merged into it
+			resourceEntry* before = g_resource_map;
+			while(before->next!=newentry){
+				before = before->next;
 			}
-			//not the right place to link, move on
-			prev = entry;
-			entry = entry->next;
+			before->next = newentry->next;
 		}
+		free_page(page_of(newentry));
+	}
+}
+
+//blocks are handed out in the size they are freed with, so both sides
+//have to agree on the rounding; a block that would leave too little of a
+//page for an entry takes the whole page
+static int round_size(kma_size_t size){
+	if(size < MIN_SIZE){
+		size = MIN_SIZE;
+	}
+	if(size > PAGESIZE - MIN_SIZE){
+		return PAGESIZE;
 	}
+	return ALIGN(size);
 }
-		
-		
 
+//merge an entry with the next one if they are adjacent on the same page
+static bool coalesce(resourceEntry* current){
+	resourceEntry* next = current->next;
+	if(next!=NULL &&
+	   (char*)current->base + current->size == (char*)next->base &&
+	   BASEADDR(current->base)==BASEADDR(next->base)){
+		current->size += next->size;
+		current->next = next->next;
+		return TRUE;
+	}
+	return FALSE;
+}
 
 // static void printResources(char* mystr){
-// 	resourceEntry* entry = (resourceEntry*)g_resource_map;
+// 	resourceEntry* entry = g_resource_map;
 // 	int counter = 0, size = 0;
-// 	int pagecounter = 0;
-// 	bool quit = FALSE;
 // 	printf("\n----PRINTING ENTRIES----\n");
-// 	int limit = 0;
-// 	int common = 0;
 // 	while(entry != NULL){
-// 		if(((kma_page_t*)entry)->size==PAGESIZE){
-// 			limit = (int)BASEADDR(((kma_page_t*)entry)->ptr) +PAGESIZE;
-// 			common = (int)BASEADDR(((kma_page_t*)entry)->ptr);
-// 			printf("PAGE: %d\tSIZE: %d\tBASE: %p\tID: %d\tMESSAGE: %s\n", pagecounter, ((kma_page_t*)entry)->size, ((kma_page_t*)entry)->ptr,((kma_page_t*)entry)->id, mystr);
-// 			pagecounter++;
-// 			entry=((kma_page_t*)entry)->ptr;
-// 		}
-// 		else{
-// 			printf("NUMBER: %d\tSIZE: %d\tBASE: %p\tBASEADDR: %p\tBASE+SIZE:%p\tNEXT: %p\tMESSAGE: %s\n", counter, entry->size, (void*)entry->base,BASEADDR(entry->base),(void*)(entry->base+entry->size),entry->next, mystr);
-// 			if (entry->size <= 0){quit = TRUE;}
-// 			if((int)BASEADDR(entry->base)!=common){
-// 				printf("adjacent entries: %p\t%p have different baseaddr: %p\n",(void*)entry->base,(void*)common,BASEADDR(entry->base));
-// 				exit(EXIT_FAILURE);
-// 			}
-// 			if((entry->base+entry->size)>limit){
-// 				printf("free space end:%p goes beyond limit of page:%p\n",(void*)(entry->base+entry->size),(void*)limit);
-// 				exit(EXIT_FAILURE);
-// 			}
-// 			size+=entry->size;
-// 			counter++;
-// 			entry=entry->next;			
-// 		}
+// 		printf("NUMBER: %d\tSIZE: %d\tBASE: %p\tBASEADDR: %p\tNEXT: %p\tMESSAGE: %s\n", counter, entry->size, entry->base, BASEADDR(entry->base), (void*)entry->next, mystr);
+// 		size+=entry->size;
+// 		counter++;
+// 		entry=entry->next;
 // 	}
 // 	printf("----PRINTED %d ENTRIES FOR %d BYTES OF FREE SPACE----\n\n", counter, size);
-// 	if (quit){exit(EXIT_FAILURE);}
 // 	return;
 // }
 
@@ -0,0 +1,526 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on the slab allocator, with
+ *             object caches that keep their objects constructed
+ ***************************************************************************/
+#ifdef KMA_SLAB
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_slab.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/* Every slab is one page. It starts with its header and an array with
+ * the index of the next free object for every object, so that the free
+ * list never touches a constructed object. The objects follow, shifted
+ * by the colour of the page. */
+typedef struct slab
+{
+  struct kma_slab_cache* cache;
+  struct slab* next;
+  struct slab* prev;
+  char* objects;
+  int in_use;
+  int free;
+  unsigned short bufctl[];
+} slab_t;
+
+#define NOFREE 0xffff
+
+/* the largest object a cache takes; the header leaves room for three
+ * of those in a slab */
+#define MAXOBJECT (PAGESIZE / 4)
+
+/* plain kma_malloc uses one general cache per power of two from
+ * MINGENERAL bytes up to MAXGENERAL; larger requests get a half page,
+ * a page or a span of their own */
+#define MINSHIFT 5
+
+#define MINGENERAL (1 << MINSHIFT)
+
+#define NUMGENERAL 7
+
+#define MAXGENERAL (MINGENERAL << (NUMGENERAL - 1))
+
+#define GENERALOF(size) ((size) <= MINGENERAL ? 0 \
+			 : 32 - __builtin_clz((size) - 1) - MINSHIFT)
+
+/* a cache without a constructor keeps up to KEEPSLABS empty slabs while
+ * it has objects in use, and none once it is idle; one with a
+ * constructor keeps all of them, for their constructed objects, until
+ * they are reaped under memory pressure */
+#define KEEPSLABS 1
+
+#define ALIGNUP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+struct kma_slab_cache
+{
+  int size;
+  int align;
+  int per_slab;
+  int offset;
+  int colours;
+  kma_object_fn_t ctor;
+  kma_object_fn_t dtor;
+  slab_t* full;
+  slab_t* partial;
+  slab_t* empty;
+  int num_empty;
+  int in_use;
+  int num_allocs;
+  int num_ctors;
+  int num_slabs;
+  int num_reaped;
+  struct kma_slab_cache* next;
+};
+
+/************Global Variables*********************************************/
+
+// the cache the cache descriptors come from
+static kma_slab_cache_t g_cache_cache;
+
+// every cache but that one, for the report and the shrinker
+static kma_slab_cache_t* g_caches = NULL;
+
+// the general caches are static too, so that a trace that only uses
+// kma_malloc leaves no page behind
+static kma_slab_cache_t g_general[NUMGENERAL];
+
+static bool g_ready = FALSE;
+
+/************Function Prototypes******************************************/
+void initCaches();
+void setupCache(kma_slab_cache_t*, int, int, kma_object_fn_t,
+		kma_object_fn_t);
+slab_t* growCache(kma_slab_cache_t*);
+void destroySlab(slab_t*);
+int reapCache(kma_slab_cache_t*, int);
+int reapCaches(void*, int);
+void linkSlab(slab_t**, slab_t*);
+void unlinkSlab(slab_t**, slab_t*);
+void* ownPages(kma_size_t);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  if (!g_ready)
+    {
+      initCaches();
+    }
+
+  if (size > MAXGENERAL)
+    {
+      return ownPages(size);
+    }
+
+  return kma_cache_alloc(&g_general[GENERALOF(size)]);
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  if (size > MAXGENERAL)
+    {
+      if (size > PAGESIZE)
+	{
+	  free_pages(page_of(ptr));
+	}
+      else
+	{
+	  free_page(page_of(ptr));
+	}
+      return;
+    }
+
+  kma_cache_free(&g_general[GENERALOF(size)], ptr);
+}
+
+kma_slab_cache_t*
+kma_cache_create(int size, int align, kma_object_fn_t ctor,
+		 kma_object_fn_t dtor)
+{
+  kma_slab_cache_t* cache;
+
+  assert(size > 0 && size <= MAXOBJECT);
+  assert((align & (align - 1)) == 0 && align <= MAXOBJECT);
+
+  if (!g_ready)
+    {
+      initCaches();
+    }
+
+  cache = kma_cache_alloc(&g_cache_cache);
+  if (cache == NULL)
+    {
+      return NULL;
+    }
+
+  setupCache(cache, size, align, ctor, dtor);
+
+  cache->next = g_caches;
+  g_caches = cache;
+
+  return cache;
+}
+
+void*
+kma_cache_alloc(kma_slab_cache_t* cache)
+{
+  slab_t* s = cache->partial;
+  void* obj;
+
+  // fill partial slabs first, so that empty ones can be given back
+  if (s == NULL)
+    {
+      s = cache->empty;
+      if (s != NULL)
+	{
+	  unlinkSlab(&cache->empty, s);
+	  cache->num_empty--;
+	}
+      else
+	{
+	  s = growCache(cache);
+	  if (s == NULL)
+	    {
+	      return NULL;
+	    }
+	}
+      linkSlab(&cache->partial, s);
+    }
+
+  assert(s->free != NOFREE);
+
+  obj = s->objects + s->free * cache->size;
+  s->free = s->bufctl[s->free];
+  s->in_use++;
+
+  if (s->free == NOFREE)
+    {
+      unlinkSlab(&cache->partial, s);
+      linkSlab(&cache->full, s);
+    }
+
+  cache->in_use++;
+  cache->num_allocs++;
+
+  return obj;
+}
+
+void
+kma_cache_free(kma_slab_cache_t* cache, void* obj)
+{
+  slab_t* s = BASEADDR(obj);
+  int i;
+
+  assert(s->cache == cache);
+  assert(s->in_use > 0);
+
+  i = ((char*) obj - s->objects) / cache->size;
+
+  if (s->free == NOFREE)
+    {
+      unlinkSlab(&cache->full, s);
+      linkSlab(&cache->partial, s);
+    }
+
+  s->bufctl[i] = s->free;
+  s->free = i;
+  s->in_use--;
+  cache->in_use--;
+
+  if (s->in_use > 0)
+    {
+      return;
+    }
+
+  unlinkSlab(&cache->partial, s);
+  linkSlab(&cache->empty, s);
+  cache->num_empty++;
+
+  // empty slabs of constructed objects wait for the shrinker; nothing
+  // is lost giving back a slab of unconstructed objects
+  if (cache->ctor == NULL)
+    {
+      reapCache(cache, cache->num_empty
+		- ((cache->in_use == 0) ? 0 : KEEPSLABS));
+    }
+}
+
+void
+kma_cache_destroy(kma_slab_cache_t* cache)
+{
+  kma_slab_cache_t** c;
+
+  assert(cache->in_use == 0);
+  assert(cache->full == NULL && cache->partial == NULL);
+
+  reapCache(cache, cache->num_empty);
+
+  for (c = &g_caches; *c != cache; c = &(*c)->next)
+    {
+      assert(*c != NULL);
+    }
+  *c = cache->next;
+
+  kma_cache_free(&g_cache_cache, cache);
+}
+
+void
+kma_report()
+{
+  kma_slab_cache_t* c;
+
+  // every allocation from a cache with a constructor beyond the objects
+  // it constructed got an object that was already set up
+  printf("Cache   Size  Per Slab Colours     Allocs      Ctors  Skipped"
+	 "   Slabs  Reaped\n");
+  for (c = g_caches; c != NULL; c = c->next)
+    {
+      printf("%5s  %5d  %8d %7d %10d %10d %8d %7d %7d\n",
+	     c->ctor != NULL ? "ctor" : "", c->size, c->per_slab, c->colours,
+	     c->num_allocs, c->num_ctors,
+	     (c->ctor != NULL && c->num_allocs > c->num_ctors)
+	     ? c->num_allocs - c->num_ctors : 0,
+	     c->num_slabs, c->num_reaped);
+    }
+}
+
+/* make the cache of cache descriptors and the general caches */
+void
+initCaches()
+{
+  int i;
+
+  g_ready = TRUE;
+
+  setupCache(&g_cache_cache, sizeof(kma_slab_cache_t), 0, NULL, NULL);
+
+  // the general caches are listed smallest first
+  for (i = NUMGENERAL - 1; i >= 0; i--)
+    {
+      setupCache(&g_general[i], MINGENERAL << i, 0, NULL, NULL);
+      g_general[i].next = g_caches;
+      g_caches = &g_general[i];
+    }
+
+  // empty slabs kept for their constructed objects can go under pressure
+  page_register_shrinker(reapCaches, NULL);
+}
+
+/* lay out the slabs of a cache: as many objects as fit after the header
+ * and the free index array, and the room left over for colouring */
+void
+setupCache(kma_slab_cache_t* cache, int size, int align, kma_object_fn_t ctor,
+	   kma_object_fn_t dtor)
+{
+  int n, left;
+
+  if (align < (int) sizeof(void*))
+    {
+      align = sizeof(void*);
+    }
+  size = ALIGNUP(size, align);
+
+  n = (PAGESIZE - sizeof(slab_t)) / (size + sizeof(unsigned short));
+  while (ALIGNUP(sizeof(slab_t) + n * sizeof(unsigned short), align)
+	 + n * size > PAGESIZE)
+    {
+      n--;
+    }
+  assert(n >= 3 && n < NOFREE);
+
+  cache->size = size;
+  cache->align = align;
+  cache->per_slab = n;
+  cache->offset = ALIGNUP(sizeof(slab_t) + n * sizeof(unsigned short), align);
+
+  // colours step by cache lines, or by the alignment if that is larger;
+  // a slab takes the colour of its page, and there are PAGECOLOURS
+  left = PAGESIZE - cache->offset - n * size;
+  cache->colours = left / ((align > CACHELINE) ? align : CACHELINE) + 1;
+  if (cache->colours > PAGECOLOURS)
+    {
+      cache->colours = PAGECOLOURS;
+    }
+
+  cache->ctor = ctor;
+  cache->dtor = dtor;
+  cache->full = cache->partial = cache->empty = NULL;
+  cache->num_empty = 0;
+  cache->in_use = 0;
+  cache->num_allocs = 0;
+  cache->num_ctors = 0;
+  cache->num_slabs = 0;
+  cache->num_reaped = 0;
+  cache->next = NULL;
+}
+
+/* make a new slab, with its objects all constructed */
+slab_t*
+growCache(kma_slab_cache_t* cache)
+{
+  kma_page_t* page = get_page();
+  slab_t* s;
+  int i, step, colour;
+
+  if (page == NULL)
+    {
+      return NULL;
+    }
+
+  assert(page->ptr == BASEADDR(page->ptr));
+
+  // a slab starts its objects at the colour of its page, so that the
+  // first objects of the slabs spread over different cache sets
+  step = (cache->align > CACHELINE) ? cache->align : CACHELINE;
+  colour = (page_colour(page->ptr) / CACHELINE) % cache->colours;
+
+  s = page->ptr;
+  s->cache = cache;
+  s->objects = (char*) s + cache->offset + colour * step;
+  s->in_use = 0;
+  s->free = 0;
+
+  for (i = 0; i < cache->per_slab; i++)
+    {
+      s->bufctl[i] = (i + 1 < cache->per_slab) ? i + 1 : NOFREE;
+      if (cache->ctor != NULL)
+	{
+	  cache->ctor(s->objects + i * cache->size);
+	  cache->num_ctors++;
+	}
+    }
+
+  cache->num_slabs++;
+
+  return s;
+}
+
+/* destroy the objects of an empty slab and give its page back */
+void
+destroySlab(slab_t* s)
+{
+  kma_slab_cache_t* cache = s->cache;
+  int i;
+
+  assert(s->in_use == 0);
+
+  if (cache->dtor != NULL)
+    {
+      for (i = 0; i < cache->per_slab; i++)
+	{
+	  cache->dtor(s->objects + i * cache->size);
+	}
+    }
+
+  cache->num_reaped++;
+
+  free_page(page_of(s));
+}
+
+/* give back up to n empty slabs of a cache; how many went */
+int
+reapCache(kma_slab_cache_t* cache, int n)
+{
+  slab_t* s;
+  int reaped = 0;
+
+  while (reaped < n && cache->empty != NULL)
+    {
+      s = cache->empty;
+      unlinkSlab(&cache->empty, s);
+      cache->num_empty--;
+      destroySlab(s);
+      reaped++;
+    }
+
+  return reaped;
+}
+
+/* the shrinker: reap the empty slabs of every cache */
+int
+reapCaches(void* arg, int wanted)
+{
+  kma_slab_cache_t* c;
+  int reaped = 0;
+
+  for (c = g_caches; c != NULL; c = c->next)
+    {
+      reaped += reapCache(c, c->num_empty);
+    }
+
+  return reaped + reapCache(&g_cache_cache, g_cache_cache.num_empty);
+}
+
+void
+linkSlab(slab_t** list, slab_t* s)
+{
+  s->prev = NULL;
+  s->next = *list;
+  if (s->next != NULL)
+    {
+      s->next->prev = s;
+    }
+  *list = s;
+}
+
+void
+unlinkSlab(slab_t** list, slab_t* s)
+{
+  if (s->prev != NULL)
+    {
+      s->prev->next = s->next;
+    }
+  else
+    {
+      *list = s->next;
+    }
+  if (s->next != NULL)
+    {
+      s->next->prev = s->prev;
+    }
+}
+
+/* a request above the largest general cache: a half page, a page or a
+ * span */
+void*
+ownPages(kma_size_t size)
+{
+  kma_page_t* page;
+
+  if (size > PAGESIZE)
+    {
+      page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+    }
+  else if (size > MINPAGESIZE)
+    {
+      page = get_page();
+    }
+  else
+    {
+      page = get_page_sized(MINPAGESIZE);
+    }
+
+  return (page == NULL) ? NULL : page->ptr;
+}
+
+#endif // KMA_SLAB
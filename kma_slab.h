@@ -0,0 +1,86 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface of the object caches of the slab allocator
+ ***************************************************************************/
+
+#ifndef __KMA_SLAB_H__
+#define __KMA_SLAB_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KMA_IMPL__
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+/* an object cache; its fields are private to the slab allocator */
+typedef struct kma_slab_cache kma_slab_cache_t;
+
+/* constructs or destroys an object in place */
+typedef void (*kma_object_fn_t)(void*);
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Creates an object cache
+ * ---------------------------------------------------------------------
+ *    Purpose: Creates a cache of objects of one size. Objects are
+ *             constructed when their slab is made and only destroyed
+ *             when it is given back, so an object freed to the cache
+ *             comes out of it again still constructed.
+ *    Input: the object size, at most a quarter page; the alignment,
+ *           a power of two (0 for pointer alignment); the constructor
+ *           and the destructor, either of them NULL for none
+ *    Output: the cache, NULL if there is no memory for it
+ ***********************************************************************/
+EXTERN kma_slab_cache_t* kma_cache_create(int, int, kma_object_fn_t,
+					  kma_object_fn_t);
+
+/***********************************************************************
+ *  Title: Allocates an object
+ * ---------------------------------------------------------------------
+ *    Purpose: Takes a constructed object from a cache
+ *    Input: the cache
+ *    Output: the object, NULL if there is no memory for it
+ ***********************************************************************/
+EXTERN void* kma_cache_alloc(kma_slab_cache_t*);
+
+/***********************************************************************
+ *  Title: Frees an object
+ * ---------------------------------------------------------------------
+ *    Purpose: Returns an object to its cache, which must be back in
+ *             its constructed state
+ *    Input: the cache, the object
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_cache_free(kma_slab_cache_t*, void*);
+
+/***********************************************************************
+ *  Title: Destroys an object cache
+ * ---------------------------------------------------------------------
+ *    Purpose: Destroys the objects of a cache and gives its pages
+ *             back; none of its objects may be in use
+ *    Input: the cache
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_cache_destroy(kma_slab_cache_t*);
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KMA_SLAB_H__ */
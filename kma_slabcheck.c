@@ -0,0 +1,194 @@
+/***************************************************************************
+ *  Title: Slab Object Cache Check
+ * -------------------------------------------------------------------------
+ *    Purpose: Checks the constructor and destructor contract of the slab
+ *             object caches, which the traces never exercise
+ ***************************************************************************/
+#define __KMA_SLABCHECK_IMPL__
+
+/************System include***********************************************/
+#include <stdlib.h>
+#include <stdio.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_slab.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define NUMOBJECTS 1000
+
+#define ROUNDS 10
+
+/* the pool is capped, so that taking every page left has the shrinker
+ * reap the cache */
+#define LIMIT 64
+
+#define MAGIC 0x5ab0b1ec
+
+/* an object as the constructor leaves it */
+typedef struct object
+{
+  int magic;
+  struct object* self;
+  char data[100 - sizeof(int) - sizeof(struct object*)];
+} object_t;
+
+/************Global Variables*********************************************/
+
+static char* name;
+static int g_ctors = 0;
+static int g_dtors = 0;
+static int g_bad = 0;
+
+// objects constructed in every page, to find the objects per slab
+static short g_page_ctors[MAXPAGES];
+
+/************Function Prototypes******************************************/
+void construct(void*);
+void destroy(void*);
+void check(bool, char*);
+void error(char*, char*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  kma_slab_cache_t* cache;
+  object_t* held[NUMOBJECTS];
+  kma_page_t* pages[LIMIT];
+  int r, i, n, slabs, per_slab, first_ctors, num_pages;
+
+  name = argv[0];
+
+  page_limit(LIMIT);
+
+  cache = kma_cache_create(sizeof(object_t), CACHELINE, construct, destroy);
+  if (cache == NULL)
+    {
+      error("Error creating the object cache", "");
+    }
+
+  first_ctors = 0;
+  for (r = 0; r < ROUNDS; r++)
+    {
+      for (i = 0; i < NUMOBJECTS; i++)
+	{
+	  held[i] = kma_cache_alloc(cache);
+	  if (held[i] == NULL)
+	    {
+	      error("Error allocating an object", "");
+	    }
+	  check(((long) held[i] & (CACHELINE - 1)) == 0,
+		"an object is not aligned");
+	  check(held[i]->magic == MAGIC && held[i]->self == held[i],
+		"an object came back unconstructed");
+	}
+      if (r == 0)
+	{
+	  first_ctors = g_ctors;
+	}
+      for (i = NUMOBJECTS - 1; i >= 0; i--)
+	{
+	  kma_cache_free(cache, held[i]);
+	}
+    }
+
+  // every slab constructed all of its objects, and only once
+  slabs = per_slab = 0;
+  for (i = 0; i < MAXPAGES; i++)
+    {
+      if (g_page_ctors[i] > 0)
+	{
+	  check(per_slab == 0 || g_page_ctors[i] == per_slab,
+		"the slabs constructed different numbers of objects");
+	  per_slab = g_page_ctors[i];
+	  slabs++;
+	}
+    }
+  check(g_ctors == slabs * per_slab,
+	"the constructors do not add up to whole slabs");
+  check(g_ctors == first_ctors,
+	"objects were constructed again when they were reused");
+  check(g_dtors == 0, "objects were destroyed before any reaping");
+
+  // take every page left; the last of them are the cache's empty slabs
+  for (num_pages = 0; num_pages < LIMIT; num_pages++)
+    {
+      pages[num_pages] = get_page();
+      if (pages[num_pages] == NULL)
+	{
+	  break;
+	}
+    }
+  check(g_dtors == g_ctors, "the shrinker did not destroy every object");
+  check(num_pages > LIMIT - slabs,
+	"the pages of the reaped slabs could not be taken");
+
+  for (n = 0; n < num_pages; n++)
+    {
+      free_page(pages[n]);
+    }
+  kma_cache_destroy(cache);
+
+  printf("Objects/Rounds:               %5d/%5d\n", NUMOBJECTS, ROUNDS);
+  printf("Allocations/Constructed:      %5d/%5d\n", NUMOBJECTS * ROUNDS,
+	 g_ctors);
+  printf("Slabs/Objects per Slab:       %5d/%5d\n", slabs, per_slab);
+  printf("Destroyed/Pages Taken:        %5d/%5d\n", g_dtors, num_pages);
+  printf("Test: %s\n", (g_bad == 0) ? "PASS" : "FAILED");
+
+  return (g_bad == 0) ? 0 : 1;
+}
+
+/* an object must not be constructed twice without being destroyed */
+void
+construct(void* ptr)
+{
+  object_t* obj = ptr;
+
+  check(obj->magic != MAGIC, "an object was constructed twice");
+  obj->magic = MAGIC;
+  obj->self = obj;
+
+  g_page_ctors[page_index(ptr)]++;
+  g_ctors++;
+}
+
+void
+destroy(void* ptr)
+{
+  object_t* obj = ptr;
+
+  check(obj->magic == MAGIC && obj->self == obj,
+	"an object was destroyed unconstructed");
+  obj->magic = 0;
+
+  g_dtors++;
+}
+
+void
+check(bool ok, char* what)
+{
+  if (!ok)
+    {
+      fprintf(stderr, "%s: %s\n", name, what);
+      g_bad++;
+    }
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(1);
+}
@@ -0,0 +1,439 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on two-level segregated fit
+ *             (TLSF), whose malloc and free take a bounded number of steps
+ ***************************************************************************/
+#ifdef KMA_TLSF
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/* A block is its size word followed by its payload. The pointer to the
+ * previous block in the page sits in the last word of that block, and
+ * is only valid while that block is free; free blocks thread their
+ * free list through the start of their payload. */
+typedef struct block
+{
+  struct block* prev_phys;
+  size_t size;
+  struct block* next_free;
+  struct block* prev_free;
+} block_t;
+
+/* the two low bits of the size: this block is free, the one before it
+ * in the page is free */
+#define BLOCKFREE 1
+
+#define PREVFREE 2
+
+#define BLOCKSIZE(b) ((b)->size & ~(size_t) 3)
+
+/* payload of a block, and the block of a payload */
+#define PAYLOAD(b) ((void*) ((char*) (b) + offsetof(block_t, next_free)))
+
+#define BLOCKOF(ptr) ((block_t*) ((char*) (ptr) \
+				  - offsetof(block_t, next_free)))
+
+#define OVERHEAD sizeof(size_t)
+
+/* the smallest payload still holds the free list links and the next
+ * block's pointer back */
+#define MINBLOCK (sizeof(block_t) - sizeof(block_t*))
+
+/* a page holds one block and a zero-sized used block closing it off;
+ * larger requests get a page or a span of their own */
+#define PAGEBLOCK (PAGESIZE - 2 * OVERHEAD)
+
+#define ALIGNSHIFT 3
+
+#define ALIGNUP(x) (((x) + (1 << ALIGNSHIFT) - 1) & ~((1 << ALIGNSHIFT) - 1))
+
+/* The first level splits sizes by powers of two, the second splits each
+ * power of two into SLCOUNT ranges. Blocks below SMALLBLOCK all fall in
+ * first level 0, in ranges of one alignment unit each. */
+#define SLSHIFT 4
+
+#define SLCOUNT (1 << SLSHIFT)
+
+#define FLSHIFT (SLSHIFT + ALIGNSHIFT)
+
+#define SMALLBLOCK (1 << FLSHIFT)
+
+#define FLCOUNT (32 - __builtin_clz(PAGEBLOCK) - FLSHIFT + 1)
+
+/* index of the highest bit set */
+#define FLS(x) (31 - __builtin_clz(x))
+
+/************Global Variables*********************************************/
+
+// a bit for every first level with a free block, and for every second
+// level range with one
+static unsigned int g_fl_map = 0;
+
+static unsigned int g_sl_map[FLCOUNT];
+
+static block_t* g_free[FLCOUNT][SLCOUNT];
+
+// blocks in use, and a whole free page kept while there are any
+static int g_used = 0;
+
+static block_t* g_spare = NULL;
+
+static int g_pages = 0;
+
+static int g_pages_freed = 0;
+
+static int g_splits = 0;
+
+static int g_merges = 0;
+
+/************Function Prototypes******************************************/
+void mapSize(size_t, int*, int*);
+block_t* findFree(size_t);
+void insertFree(block_t*);
+void removeFree(block_t*);
+block_t* addPage();
+void dropPage(block_t*);
+void splitBlock(block_t*, size_t);
+block_t* mergeBlock(block_t*);
+block_t* nextPhys(block_t*);
+void* ownPages(kma_size_t);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  block_t* b;
+  size_t want;
+
+  if (size > PAGEBLOCK)
+    {
+      return ownPages(size);
+    }
+
+  want = (size < MINBLOCK) ? MINBLOCK : ALIGNUP(size);
+
+  // a kept whole page takes what rounding keeps out of the free lists
+  b = findFree(want);
+  if (b == NULL)
+    {
+      b = (g_spare != NULL) ? g_spare : addPage();
+      if (b == NULL)
+	{
+	  return NULL;
+	}
+    }
+  removeFree(b);
+
+  splitBlock(b, want);
+
+  b->size &= ~BLOCKFREE;
+  nextPhys(b)->size &= ~PREVFREE;
+  g_used++;
+
+  return PAYLOAD(b);
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  block_t* b;
+
+  if (size > PAGEBLOCK)
+    {
+      if (size > PAGESIZE)
+	{
+	  free_pages(page_of(ptr));
+	}
+      else
+	{
+	  free_page(page_of(ptr));
+	}
+      return;
+    }
+
+  b = BLOCKOF(ptr);
+  assert(!(b->size & BLOCKFREE));
+
+  g_used--;
+  b = mergeBlock(b);
+
+  if (BLOCKSIZE(b) < PAGEBLOCK)
+    {
+      insertFree(b);
+    }
+  else if (g_used > 0 && g_spare == NULL)
+    {
+      // a whole free page is kept while the allocator is busy, so that
+      // a request at the edge of a page does not map and unmap it
+      insertFree(b);
+      g_spare = b;
+    }
+  else
+    {
+      dropPage(b);
+    }
+
+  if (g_used == 0 && g_spare != NULL)
+    {
+      b = g_spare;
+      removeFree(b);
+      dropPage(b);
+    }
+}
+
+void
+kma_report()
+{
+  printf("TLSF Pages Taken/Freed:      %5d/%5d\n", g_pages, g_pages_freed);
+  printf("TLSF Splits/Merges:          %5d/%5d\n", g_splits, g_merges);
+}
+
+/* first and second level of a block size */
+void
+mapSize(size_t size, int* fl, int* sl)
+{
+  int f;
+
+  if (size < SMALLBLOCK)
+    {
+      *fl = 0;
+      *sl = size >> ALIGNSHIFT;
+    }
+  else
+    {
+      f = FLS(size);
+      *fl = f - FLSHIFT + 1;
+      *sl = (size >> (f - SLSHIFT)) ^ SLCOUNT;
+    }
+}
+
+/* a free block of at least size bytes. The size is rounded up to the
+ * next second level range, so that any block there fits; the bitmaps
+ * then give the first such range that is not empty. */
+block_t*
+findFree(size_t size)
+{
+  unsigned int map;
+  int fl, sl;
+
+  if (size >= SMALLBLOCK)
+    {
+      size += (1 << (FLS(size) - SLSHIFT)) - 1;
+    }
+  mapSize(size, &fl, &sl);
+
+  if (fl >= FLCOUNT)
+    {
+      return NULL;
+    }
+
+  map = g_sl_map[fl] & (~0U << sl);
+  if (map == 0)
+    {
+      map = g_fl_map & (~0U << (fl + 1));
+      if (map == 0)
+	{
+	  return NULL;
+	}
+      fl = __builtin_ctz(map);
+      map = g_sl_map[fl];
+    }
+  sl = __builtin_ctz(map);
+
+  return g_free[fl][sl];
+}
+
+void
+insertFree(block_t* b)
+{
+  int fl, sl;
+
+  mapSize(BLOCKSIZE(b), &fl, &sl);
+
+  b->prev_free = NULL;
+  b->next_free = g_free[fl][sl];
+  if (b->next_free != NULL)
+    {
+      b->next_free->prev_free = b;
+    }
+  g_free[fl][sl] = b;
+
+  g_fl_map |= 1U << fl;
+  g_sl_map[fl] |= 1U << sl;
+}
+
+void
+removeFree(block_t* b)
+{
+  int fl, sl;
+
+  mapSize(BLOCKSIZE(b), &fl, &sl);
+
+  if (b->prev_free != NULL)
+    {
+      b->prev_free->next_free = b->next_free;
+    }
+  else
+    {
+      g_free[fl][sl] = b->next_free;
+      if (b->next_free == NULL)
+	{
+	  g_sl_map[fl] &= ~(1U << sl);
+	  if (g_sl_map[fl] == 0)
+	    {
+	      g_fl_map &= ~(1U << fl);
+	    }
+	}
+    }
+  if (b->next_free != NULL)
+    {
+      b->next_free->prev_free = b->prev_free;
+    }
+
+  if (b == g_spare)
+    {
+      g_spare = NULL;
+    }
+}
+
+/* take a page and make it one free block, on its free list. The
+ * block's size word is the first word of the page, so its (unused)
+ * pointer back lies just before it. */
+block_t*
+addPage()
+{
+  kma_page_t* page = get_page();
+  block_t* b;
+  block_t* end;
+
+  if (page == NULL)
+    {
+      return NULL;
+    }
+
+  b = (block_t*) ((char*) page->ptr - offsetof(block_t, size));
+  b->size = PAGEBLOCK | BLOCKFREE;
+
+  end = nextPhys(b);
+  end->prev_phys = b;
+  end->size = PREVFREE;
+
+  insertFree(b);
+  g_pages++;
+
+  return b;
+}
+
+/* give back the page of a free block that covers all of it */
+void
+dropPage(block_t* b)
+{
+  assert(BLOCKSIZE(b) == PAGEBLOCK);
+
+  free_page(page_of(&b->size));
+  g_pages_freed++;
+}
+
+/* cut what a request of size bytes does not need off a block, as a
+ * free block of its own */
+void
+splitBlock(block_t* b, size_t size)
+{
+  block_t* rest;
+  size_t left = BLOCKSIZE(b) - size;
+
+  if (left < sizeof(block_t))
+    {
+      return;
+    }
+
+  b->size = size | (b->size & 3);
+
+  rest = nextPhys(b);
+  rest->size = (left - OVERHEAD) | BLOCKFREE;
+  nextPhys(rest)->prev_phys = rest;
+
+  // the block itself is about to be handed out
+  rest->size &= ~PREVFREE;
+  insertFree(rest);
+  g_splits++;
+}
+
+/* mark a block free and merge it with the free blocks on either side;
+ * the merged block is not yet on a free list */
+block_t*
+mergeBlock(block_t* b)
+{
+  block_t* next = nextPhys(b);
+  block_t* prev;
+
+  if (b->size & PREVFREE)
+    {
+      prev = b->prev_phys;
+      removeFree(prev);
+      prev->size += BLOCKSIZE(b) + OVERHEAD;
+      b = prev;
+      g_merges++;
+    }
+
+  if (next->size & BLOCKFREE)
+    {
+      removeFree(next);
+      b->size += BLOCKSIZE(next) + OVERHEAD;
+      g_merges++;
+    }
+
+  b->size |= BLOCKFREE;
+  next = nextPhys(b);
+  next->prev_phys = b;
+  next->size |= PREVFREE;
+
+  return b;
+}
+
+/* the block after this one in its page */
+block_t*
+nextPhys(block_t* b)
+{
+  return (block_t*) ((char*) PAYLOAD(b) + BLOCKSIZE(b) - OVERHEAD);
+}
+
+/* a request larger than a page block: a page or a span */
+void*
+ownPages(kma_size_t size)
+{
+  kma_page_t* page;
+
+  if (size > PAGESIZE)
+    {
+      page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+    }
+  else
+    {
+      page = get_page();
+    }
+
+  return (page == NULL) ? NULL : page->ptr;
+}
+
+#endif // KMA_TLSF